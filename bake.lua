@@ -2,7 +2,7 @@ require("bake_stubs")
 
 local target = "bake"
 local ccflags = "-g"
-local ldflags = "-g -llua5.3"
+local ldflags = "-g -llua5.3 -lpthread"
 
 -- neat utility functions :P
 local src = pantry.collect("src", ".c")
@@ -13,6 +13,9 @@ recipe("build/" .. target, obj, function(output, input)
 	whisk("gcc " .. obj_str .. " " .. ldflags .. " -o " .. output).err(true)
 end)
 
+-- LD_PRELOAD shim for --trace, it lives next to the bake binary
+recipe("build/libbaketrace.so", { "shim/trace.c" }, "gcc -shared -fPIC -g $< -o $@ -ldl")
+
 -- "ALWAYS" dependent targets will always get run, as long as they get referenced by something.
 recipe("build", { "ALWAYS" }, function()
 	pantry.new_shelf("build")
@@ -20,6 +23,7 @@ end)
 
 recipe("install", { "ALWAYS" }, function()
 	whisk("cp build/" .. target .. " /bin/" .. target).err(false)
+	whisk("cp build/libbaketrace.so /bin/libbaketrace.so").err(false)
 	local stub_file = "bake_stubs.lua"
 
 	local first_path = package.path:match("([^;]+)"):gsub("%?%.lua$", "")
@@ -43,8 +47,13 @@ recipe("build/%.o", { "src/%.c" }, function(output, input)
 	whisk("gcc -D'VERSION=\"" .. timestr .. "\"' -c " .. input[1] .. " " .. ccflags .. " -o " .. output).err(true)
 end)
 
+-- Synthetic-graph benchmarks, results end up in build/bench.json
+recipe("bench", { "build/" .. target, "ALWAYS" }, function(output, input)
+	whisk("sh bench/bench.sh " .. input[1] .. " build/bench.json").err(true)
+end)
+
 recipe("clean", { "ALWAYS" }, function()
 	whisk("rm -rf build").err(false)
 end)
 
-bake({ "build", "build/" .. target })
+bake({ "build", "build/" .. target, "build/libbaketrace.so" })
@@ -3,15 +3,27 @@
 ---@field output string
 ---@field err fun(do_exit:boolean):void
 
----@type fun(cmd:string):WhiskResult
+--- opts.cache replays the result from .bake/whisk while the command, the
+--- contents of cache.inputs and the values of cache.env stay the same.
+---@type fun(cmd:string, opts?:{cache?:boolean|{inputs?:string[], env?:string[]}}):WhiskResult
 whisk = whisk
 
----@type fun(tbl:table):void
+---@class Bake
+---@field include fun(dir:string, file?:string):table
+---@operator call(tbl:table):void
 bake = bake
 
----@type fun(name:string, deps:table, fn:function):void
+--- fn is either a Lua function or a shell command, in which $@, $< and $^
+--- expand to the target, first dependency and all dependencies. Pattern
+--- recipes can set opts.unity to compile their sources that many at a time.
+---@type fun(name:string, deps:table, fn:function|string, opts?:{unity?:integer}):void
 recipe = recipe
 
+--- cmd runs once per shard with TEST_SHARD_INDEX and TEST_TOTAL_SHARDS set,
+--- and is skipped if it passed before with the same deps.
+---@type fun(name:string, deps:table, cmd:string, opts?:{timeout?:number, shards?:integer}):void
+test = test
+
 ---@type fun(msg:string):void
 yell = yell
 print = print
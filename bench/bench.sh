@@ -0,0 +1,79 @@
+#!/bin/sh
+# Synthetic-graph benchmark for Bake.
+#
+# Usage: bench/bench.sh <bake binary> <results.json>
+#
+# For every shape and size a throwaway project is generated, then built cold
+# (no outputs) and again as a no-op (everything fresh). Wall time comes from
+# here, everything else from Bake's --stats-json. Override the matrix with
+# BENCH_SHAPES and BENCH_SIZES.
+
+set -e
+
+BAKE=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+OUT=$2
+GRAPH=$(cd "$(dirname "$0")" && pwd)/graph.lua
+SHAPES=${BENCH_SHAPES:-flat fanin deep diamond tree}
+SIZES=${BENCH_SIZES:-1000 10000 50000 200000}
+WORK=${BENCH_DIR:-${TMPDIR:-/tmp}/bake-bench.$$}
+
+if [ -z "$1" ] || [ -z "$2" ]; then
+	echo "Usage: $0 <bake binary> <results.json>" >&2
+	exit 1
+fi
+
+now_ns() {
+	date +%s%N
+}
+
+# make_sources <dir> <count> <shape>
+make_sources() {
+	mkdir -p "$1/src" "$1/out"
+	if [ "$3" = tree ]; then
+		# 10 x 10 directories, the files spread evenly over them
+		for d in 0 1 2 3 4 5 6 7 8 9; do
+			for e in 0 1 2 3 4 5 6 7 8 9; do
+				mkdir -p "$1/src/d$d/e$e"
+			done
+		done
+		seq 0 $(($2 - 1)) | awk -v dir="$1/src" \
+			'{ printf "%s/d%d/e%d/%d.c\n", dir, $1 % 10, int($1 / 10) % 10, $1 }' |
+			xargs touch
+	else
+		seq 0 $(($2 - 1)) | sed "s|.*|$1/src/&.c|" | xargs touch
+	fi
+}
+
+# run <label> <dir> <shape> <nodes>
+run() {
+	stats="$WORK/stats.json"
+	start=$(now_ns)
+	(cd "$2" && BENCH_SHAPE=$3 BENCH_NODES=$4 "$BAKE" -f "$GRAPH" \
+		--stats-json "$stats" 2>/dev/null)
+	end=$(now_ns)
+
+	[ "$first" = 1 ] || printf ',\n' >>"$OUT"
+	first=0
+	printf '  {"shape": "%s", "nodes": %s, "run": "%s", "wall_time": %s, "stats": %s}' \
+		"$3" "$4" "$1" "$(awk -v ns=$((end - start)) 'BEGIN { printf "%.6f", ns / 1e9 }')" \
+		"$(tr -d '\n' <"$stats")" >>"$OUT"
+	echo "$3 $4 $1: $(awk -v ns=$((end - start)) 'BEGIN { printf "%.3fs", ns / 1e9 }')" >&2
+}
+
+mkdir -p "$WORK"
+trap 'rm -rf "$WORK"' EXIT
+
+printf '[\n' >"$OUT"
+first=1
+for shape in $SHAPES; do
+	for nodes in $SIZES; do
+		dir="$WORK/$shape-$nodes"
+		make_sources "$dir" "$nodes" "$shape"
+		run cold "$dir" "$shape" "$nodes"
+		run noop "$dir" "$shape" "$nodes"
+		rm -rf "$dir"
+	done
+done
+printf '\n]\n' >>"$OUT"
+
+echo "Results written to $OUT" >&2
@@ -0,0 +1,73 @@
+-- Synthetic build graphs for bench/bench.sh.
+-- BENCH_SHAPE picks the graph, BENCH_NODES its rough size. Every recipe just
+-- touches its output, so the numbers are Bake's own overhead.
+
+local shape = os.getenv("BENCH_SHAPE") or "flat"
+local n = tonumber(os.getenv("BENCH_NODES") or "1000")
+
+local function touch(output)
+	io.open(output, "w"):close()
+end
+
+local function source(i)
+	return "src/" .. i .. ".c"
+end
+
+local goals = {}
+
+if shape == "flat" then
+	-- n independent objects from one wildcard rule over a flat directory
+	recipe("out/%.o", { "src/%.c" }, touch)
+	goals = pantry.objects(pantry.collect("src", ".c"), "src/", "out/", ".c", ".o")
+elseif shape == "fanin" then
+	-- n objects all feeding a single link step
+	local objs = {}
+	for i = 0, n - 1 do
+		objs[#objs + 1] = "out/" .. i .. ".o"
+		recipe(objs[#objs], { source(i) }, touch)
+	end
+	recipe("out/all", objs, touch)
+	goals = { "out/all" }
+elseif shape == "deep" then
+	-- chains of up to 10000 steps, each depending on the previous one
+	local depth = math.min(n, 10000)
+	for c = 0, math.ceil(n / depth) - 1 do
+		local prev = source(c)
+		for d = 0, depth - 1 do
+			local target = "out/c" .. c .. "_" .. d
+			recipe(target, { prev }, touch)
+			prev = target
+		end
+		goals[#goals + 1] = prev
+	end
+elseif shape == "diamond" then
+	-- layers of 100 nodes, each depending on two nodes of the layer below
+	local width = math.min(n, 100)
+	for l = 0, math.ceil(n / width) - 1 do
+		for i = 0, width - 1 do
+			local deps
+			if l == 0 then
+				deps = { source(i) }
+			else
+				local below = "out/l" .. (l - 1) .. "_"
+				deps = { below .. i, below .. ((i + 1) % width) }
+			end
+			recipe("out/l" .. l .. "_" .. i, deps, touch)
+		end
+		goals = {}
+		for i = 0, width - 1 do
+			goals[#goals + 1] = "out/l" .. l .. "_" .. i
+		end
+	end
+elseif shape == "tree" then
+	-- sources spread over a nested directory tree
+	for _, src in ipairs(pantry.collect("src", ".c")) do
+		local obj = "out/" .. src:gsub("/", "_") .. ".o"
+		recipe(obj, { src }, touch)
+		goals[#goals + 1] = obj
+	end
+else
+	error("Unknown BENCH_SHAPE: " .. shape)
+end
+
+bake(goals)
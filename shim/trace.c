@@ -0,0 +1,181 @@
+// libbaketrace.so: LD_PRELOAD shim used by `bake --trace`.
+//
+// Appends one line per successful file access to $BAKE_TRACE_FILE:
+// "<kind> <absolute path>", where kind is r (opened for reading),
+// w (opened for writing), s (stat'ed or checked) or x (executed).
+// Lines are written with a single O_APPEND write, so every process of a
+// command can share the file.
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int trace_fd = -1;	 // -2 once we know there's nowhere to write
+static __thread int busy;	 // don't trace our own calls
+
+#define REAL(name) \
+	static __typeof__(name)* real_##name; \
+	if (!real_##name) real_##name = dlsym(RTLD_NEXT, #name)
+
+static void record(char kind, int dirfd, const char* path) {
+	if (!path || !*path || busy) return;
+	busy = 1;
+
+	// racy between threads, worst case the file is opened twice
+	if (trace_fd == -1) {
+		const char* file = getenv("BAKE_TRACE_FILE");
+		trace_fd = file ? open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+							   0644)
+						: -2;
+		if (trace_fd < 0) trace_fd = -2;
+	}
+
+	if (trace_fd >= 0) {
+		char base[PATH_MAX] = "";
+		if (path[0] != '/') {
+			if (dirfd == AT_FDCWD) {
+				if (!getcwd(base, sizeof(base))) base[0] = '\0';
+			} else {
+				char link[64];
+				snprintf(link, sizeof(link), "/proc/self/fd/%d", dirfd);
+				ssize_t n = readlink(link, base, sizeof(base) - 1);
+				base[n > 0 ? n : 0] = '\0';
+			}
+		}
+
+		char line[PATH_MAX * 2 + 8];
+		int n = snprintf(line, sizeof(line), "%c %s%s%s\n", kind, base,
+						 base[0] ? "/" : "", path);
+		if (n > 0 && (size_t)n < sizeof(line)) {
+			ssize_t w = write(trace_fd, line, n);
+			(void)w;
+		}
+	}
+	busy = 0;
+}
+
+static char open_kind(int flags) {
+	return (flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC)) ? 'w' : 'r';
+}
+
+static char fopen_kind(const char* mode) {
+	return strpbrk(mode, "wa+") ? 'w' : 'r';
+}
+
+int open(const char* path, int flags, ...) {
+	REAL(open);
+	mode_t mode = 0;
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	int fd = real_open(path, flags, mode);
+	if (fd >= 0) record(open_kind(flags), AT_FDCWD, path);
+	return fd;
+}
+
+int open64(const char* path, int flags, ...) {
+	REAL(open64);
+	mode_t mode = 0;
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	int fd = real_open64(path, flags, mode);
+	if (fd >= 0) record(open_kind(flags), AT_FDCWD, path);
+	return fd;
+}
+
+int openat(int dirfd, const char* path, int flags, ...) {
+	REAL(openat);
+	mode_t mode = 0;
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	int fd = real_openat(dirfd, path, flags, mode);
+	if (fd >= 0) record(open_kind(flags), dirfd, path);
+	return fd;
+}
+
+int openat64(int dirfd, const char* path, int flags, ...) {
+	REAL(openat64);
+	mode_t mode = 0;
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	int fd = real_openat64(dirfd, path, flags, mode);
+	if (fd >= 0) record(open_kind(flags), dirfd, path);
+	return fd;
+}
+
+FILE* fopen(const char* path, const char* mode) {
+	REAL(fopen);
+	FILE* f = real_fopen(path, mode);
+	if (f) record(fopen_kind(mode), AT_FDCWD, path);
+	return f;
+}
+
+FILE* fopen64(const char* path, const char* mode) {
+	REAL(fopen64);
+	FILE* f = real_fopen64(path, mode);
+	if (f) record(fopen_kind(mode), AT_FDCWD, path);
+	return f;
+}
+
+int stat(const char* path, struct stat* st) {
+	REAL(stat);
+	int r = real_stat(path, st);
+	if (r == 0) record('s', AT_FDCWD, path);
+	return r;
+}
+
+int lstat(const char* path, struct stat* st) {
+	REAL(lstat);
+	int r = real_lstat(path, st);
+	if (r == 0) record('s', AT_FDCWD, path);
+	return r;
+}
+
+int fstatat(int dirfd, const char* path, struct stat* st, int flags) {
+	REAL(fstatat);
+	int r = real_fstatat(dirfd, path, st, flags);
+	if (r == 0 && !(flags & AT_EMPTY_PATH && !*path)) record('s', dirfd, path);
+	return r;
+}
+
+int access(const char* path, int mode) {
+	REAL(access);
+	int r = real_access(path, mode);
+	if (r == 0) record('s', AT_FDCWD, path);
+	return r;
+}
+
+int execve(const char* path, char* const argv[], char* const envp[]) {
+	REAL(execve);
+	record('x', AT_FDCWD, path);  // on success there's no coming back
+	return real_execve(path, argv, envp);
+}
+
+int execv(const char* path, char* const argv[]) {
+	REAL(execv);
+	record('x', AT_FDCWD, path);
+	return real_execv(path, argv);
+}
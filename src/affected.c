@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bake.h"
+
+// Marks every recipe reachable from the changed files through the reverse
+// edges, then prints the final ones (targets nothing else depends on).
+void print_affected(const char** files, int count) {
+	recipes_index_dependents();
+
+	char* marked = calloc(recipe_arr.count ? recipe_arr.count : 1, 1);
+	size_t* queue =
+		malloc((recipe_arr.count ? recipe_arr.count : 1) * sizeof(*queue));
+	if (!marked || !queue) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	size_t head = 0, tail = 0;
+
+	for (int i = 0; i < count; i++) {
+		const char* file = files[i];
+		while (strncmp(file, "./", 2) == 0) file += 2;
+
+		int node = node_lookup(file);
+		if (node < 0) continue;	 // not part of the graph
+
+		// a changed generated file affects its own recipe too
+		int own = node_arr.data[node].recipe;
+		if (own >= 0 && !marked[own]) {
+			marked[own] = 1;
+			queue[tail++] = own;
+		}
+
+		size_t n;
+		const size_t* deps = recipe_dependents(node, &n);
+		for (size_t j = 0; j < n; j++) {
+			if (marked[deps[j]]) continue;
+			marked[deps[j]] = 1;
+			queue[tail++] = deps[j];
+		}
+	}
+
+	while (head < tail) {
+		size_t n;
+		const size_t* deps =
+			recipe_dependents(recipe_arr.data[queue[head++]].target, &n);
+		for (size_t j = 0; j < n; j++) {
+			if (marked[deps[j]]) continue;
+			marked[deps[j]] = 1;
+			queue[tail++] = deps[j];
+		}
+	}
+
+	for (size_t i = 0; i < recipe_arr.count; i++) {
+		if (!marked[i]) continue;
+		size_t n;
+		recipe_dependents(recipe_arr.data[i].target, &n);
+		if (n == 0) printf("%s\n", node_path(recipe_arr.data[i].target));
+	}
+
+	free(queue);
+	free(marked);
+}
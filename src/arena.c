@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bake.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct ArenaBlock {
+	struct ArenaBlock* next;
+	size_t used;
+	size_t size;
+	_Alignas(ARENA_ALIGN) char data[];
+};
+
+void* arena_alloc(Arena* a, size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if (!a->head || a->head->used + size > a->head->size) {
+		// oversized requests get a block of their own
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		ArenaBlock* b = malloc(sizeof(ArenaBlock) + block_size);
+		if (!b) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		b->used = 0;
+		b->size = block_size;
+		b->next = a->head;
+		a->head = b;
+		a->bytes += sizeof(ArenaBlock) + block_size;
+	}
+
+	void* p = a->head->data + a->head->used;
+	a->head->used += size;
+	return p;
+}
+
+char* arena_strdup(Arena* a, const char* s) {
+	size_t len = strlen(s) + 1;
+	char* p = arena_alloc(a, len);
+	memcpy(p, s, len);
+	return p;
+}
+
+void arena_free(Arena* a) {
+	ArenaBlock* b = a->head;
+	while (b) {
+		ArenaBlock* next = b->next;
+		free(b);
+		b = next;
+	}
+	a->head = NULL;
+	a->bytes = 0;
+}
@@ -7,16 +7,47 @@
 #define VERSION "Unknown"
 #endif
 
-#define HELP_STR                                                    \
-	"Usage: bake [options] [rules]\n"                               \
-	"\nArguments:\n"                                                \
-	"  <rules>    Optional rule names to run instead of defaults\n" \
-	"\nOptions:\n"                                                  \
-	"  -B         Force all rules to be remade\n"                   \
-	"  -f <file>  Specify a Bake Lua file (default: bake.lua)\n"    \
-	"  -C <dir>   Use <dir> as the working directory\n"             \
-	"  -d         Keeps defaults even with <rules> passed\n"        \
-	"  -v         Print version information and exit\n"             \
+#define HELP_STR                                                          \
+	"Usage: bake [options] [rules]\n"                                     \
+	"\nArguments:\n"                                                      \
+	"  <rules>    Optional rule names to run instead of defaults\n"       \
+	"\nOptions:\n"                                                        \
+	"  -B         Force all rules to be remade\n"                         \
+	"  -n         Print the recipes that would run, in order, without\n"  \
+	"             running them\n"                                         \
+	"  --explain  Print why each recipe is (re)made\n"                    \
+	"  -f <file>  Specify a Bake Lua file (default: bake.lua)\n"          \
+	"  -C <dir>   Use <dir> as the working directory\n"                   \
+	"  -d         Keeps defaults even with <rules> passed\n"              \
+	"  -j <n>     Run up to <n> command recipes at once (default: 1)\n"   \
+	"  --workers <socket,...>\n"                                          \
+	"             Also send command recipes to these bake-workers\n"      \
+	"  --worker <socket>\n"                                               \
+	"             Run as a bake-worker daemon listening on <socket>\n"    \
+	"  --cache <url>\n"                                                   \
+	"             Share command recipe outputs through the HTTP cache\n"  \
+	"             at <url> (http://host:port[/path])\n"                   \
+	"  --cache-server <[host:]port>\n"                                    \
+	"             Run a cache server keeping artifacts in the current\n"  \
+	"             directory (host defaults to 127.0.0.1)\n"               \
+	"  --trace    Trace the files commands touch and record undeclared\n" \
+	"             inputs as dependencies\n"                               \
+	"  --no-progress\n"                                                   \
+	"             Hide the progress line and periodic summaries\n"        \
+	"  --stats    Print build statistics when finished\n"                 \
+	"  --stats-json <file>\n"                                             \
+	"             Write build statistics to <file> as JSON\n"             \
+	"  --metrics-file <file>\n"                                           \
+	"             Write build metrics to <file> in Prometheus format\n"   \
+	"  --log-format=<text|json>\n"                                        \
+	"             Log as colored text (default) or JSON lines\n"          \
+	"  --clean    Remove the outputs Bake produced for <rules> (or the\n" \
+	"             defaults) and everything they depend on\n"              \
+	"  --prune    Remove outputs Bake produced that no recipe claims\n"   \
+	"  --affected <files...>\n"                                           \
+	"             Print the final targets affected by <files> and\n"      \
+	"             exit without building\n"                                \
+	"  -v         Print version information and exit\n"                   \
 	"  -h         Show this help message and exit\n"
 
 BakeOptions parse_args(int argc, char** argv) {
@@ -27,6 +58,24 @@ BakeOptions parse_args(int argc, char** argv) {
 		.targets = NULL,
 		.target_count = 0,
 		.keep_defaults = 0,
+		.affected = NULL,
+		.affected_count = 0,
+		.stats = 0,
+		.stats_json = NULL,
+		.metrics_file = NULL,
+		.log_format = LOG_TEXT,
+		.jobs = 1,
+		.workers = NULL,
+		.worker_count = 0,
+		.worker_socket = NULL,
+		.trace = 0,
+		.progress = 1,
+		.clean = 0,
+		.prune = 0,
+		.dry_run = 0,
+		.explain = 0,
+		.cache_url = NULL,
+		.cache_server = NULL,
 	};
 
 	const char** targets = malloc(sizeof(char*) * argc);
@@ -36,6 +85,7 @@ BakeOptions parse_args(int argc, char** argv) {
 	}
 
 	int tcount = 0;
+	const char** affected = NULL;
 
 	for (int i = 1; i < argc; i++) {
 		/* exit-immediately flags */
@@ -59,6 +109,95 @@ BakeOptions parse_args(int argc, char** argv) {
 			continue;
 		}
 
+		if (strcmp(argv[i], "--stats-json") == 0) {
+			if (++i >= argc) {
+				print("Option --stats-json requires a filename");
+				exit(1);
+			}
+			opts.stats_json = argv[i];
+			continue;
+		}
+
+		if (strcmp(argv[i], "--metrics-file") == 0) {
+			if (++i >= argc) {
+				print("Option --metrics-file requires a filename");
+				exit(1);
+			}
+			opts.metrics_file = argv[i];
+			continue;
+		}
+
+		if (strncmp(argv[i], "--log-format=", 13) == 0) {
+			const char* format = argv[i] + 13;
+			if (strcmp(format, "text") == 0) {
+				opts.log_format = LOG_TEXT;
+			} else if (strcmp(format, "json") == 0) {
+				opts.log_format = LOG_JSON;
+			} else {
+				print("Unknown log format: %s", format);
+				exit(1);
+			}
+			continue;
+		}
+
+		if (strncmp(argv[i], "-j", 2) == 0) {
+			const char* n = argv[i][2] ? argv[i] + 2 : NULL;
+			if (!n && ++i < argc) n = argv[i];
+			if (!n || atoi(n) < 1) {
+				print("Option -j requires a positive job count");
+				exit(1);
+			}
+			opts.jobs = atoi(n);
+			continue;
+		}
+
+		if (strcmp(argv[i], "--workers") == 0) {
+			if (++i >= argc) {
+				print("Option --workers requires a socket list");
+				exit(1);
+			}
+			// comma separated, every entry is one more job slot
+			size_t max = opts.worker_count + strlen(argv[i]) + 1;
+			char* list = strdup(argv[i]);
+			const char** workers = realloc(opts.workers, sizeof(char*) * max);
+			if (!list || !workers) {
+				print("Out of memory");
+				exit(1);
+			}
+			opts.workers = workers;
+			for (char* w = strtok(list, ","); w; w = strtok(NULL, ",")) {
+				opts.workers[opts.worker_count++] = w;
+			}
+			continue;
+		}
+
+		if (strcmp(argv[i], "--worker") == 0) {
+			if (++i >= argc) {
+				print("Option --worker requires a socket path");
+				exit(1);
+			}
+			opts.worker_socket = argv[i];
+			continue;
+		}
+
+		if (strcmp(argv[i], "--cache") == 0) {
+			if (++i >= argc) {
+				print("Option --cache requires a URL");
+				exit(1);
+			}
+			opts.cache_url = argv[i];
+			continue;
+		}
+
+		if (strcmp(argv[i], "--cache-server") == 0) {
+			if (++i >= argc) {
+				print("Option --cache-server requires a port");
+				exit(1);
+			}
+			opts.cache_server = argv[i];
+			continue;
+		}
+
 		if (strcmp(argv[i], "-C") == 0) {
 			if (++i >= argc) {
 				print("Option -C requires a directory");
@@ -68,6 +207,16 @@ BakeOptions parse_args(int argc, char** argv) {
 			continue;
 		}
 
+		/* everything positional after this is a changed file */
+		if (strcmp(argv[i], "--affected") == 0) {
+			if (!affected) affected = malloc(sizeof(char*) * argc);
+			if (!affected) {
+				print("Out of memory");
+				exit(1);
+			}
+			continue;
+		}
+
 		/* simple flags */
 		if (strcmp(argv[i], "-B") == 0) {
 			opts.force = 1;
@@ -79,8 +228,47 @@ BakeOptions parse_args(int argc, char** argv) {
 			continue;
 		}
 
+		if (strcmp(argv[i], "-n") == 0) {
+			opts.dry_run = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--explain") == 0) {
+			opts.explain = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--clean") == 0) {
+			opts.clean = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--prune") == 0) {
+			opts.prune = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--no-progress") == 0) {
+			opts.progress = 0;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--trace") == 0) {
+			opts.trace = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--stats") == 0) {
+			opts.stats = 1;
+			continue;
+		}
+
 		/* positional arguments */
 		if (argv[i][0] != '-') {
+			if (affected) {
+				affected[opts.affected_count++] = argv[i];
+				continue;
+			}
 			targets[tcount++] = argv[i];
 			continue;
 		}
@@ -90,6 +278,7 @@ BakeOptions parse_args(int argc, char** argv) {
 		exit(1);
 	}
 
+	opts.affected = affected;
 	opts.targets = targets;
 	opts.target_count = tcount;
 	return opts;
@@ -3,25 +3,197 @@
 #include <lua5.3/lauxlib.h>
 #include <lua5.3/lua.h>
 #include <lua5.3/lualib.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
+
+// stat(2) wrapper so the build statistics can count the syscalls
+int bake_stat(const char* path, struct stat* st) {
+	stats.stat_calls++;
+	return stat(path, st);
+}
 
 int exists(const char* fname) {
 	struct stat st;
-	return stat(fname, &st) == 0;
+	return bake_stat(fname, &st) == 0;
+}
+
+// Creates the directories leading up to path (but not path itself)
+int mkdir_parents(const char* path) {
+	char* tmp = strdup(path);
+	if (!tmp) return 0;
+
+	for (char* p = tmp + 1; *p; p++) {
+		if (*p != '/') continue;
+		*p = '\0';
+		if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
+			free(tmp);
+			return 0;
+		}
+		*p = '/';
+	}
+	free(tmp);
+	return 1;
+}
+
+// Reads a whole file into a NUL terminated heap buffer
+char* read_file(const char* path, size_t* len) {
+	FILE* f = fopen(path, "rb");
+	if (!f) return NULL;
+
+	size_t cap = 4096, n = 0;
+	char* data = malloc(cap);
+	while (data) {
+		n += fread(data + n, 1, cap - n - 1, f);
+		if (n < cap - 1) break;
+		cap *= 2;
+		char* tmp = realloc(data, cap);
+		if (!tmp) free(data);
+		data = tmp;
+	}
+	int failed = ferror(f);
+	fclose(f);
+	if (!data || failed) {
+		free(data);
+		return NULL;
+	}
+	data[n] = '\0';
+	if (len) *len = n;
+	return data;
+}
+
+// Lexically resolves ".", ".." and repeated slashes in place. Relative
+// paths keep the ".." they can't resolve, an empty result becomes ".".
+void normalize_path(char* path) {
+	int absolute = path[0] == '/';
+	char* base = path + absolute;  // never backtrack past this
+	char* out = base;
+	char* p = base;
+	while (*p) {
+		size_t len = strcspn(p, "/");
+
+		if (len == 0 || (len == 1 && p[0] == '.')) {
+			// skip
+		} else if (len == 2 && p[0] == '.' && p[1] == '.') {
+			char* last = out;
+			while (last > base && last[-1] != '/') last--;
+			int parent = out - last == 2 && memcmp(last, "..", 2) == 0;
+			if (out > base && !parent) {
+				out = last > base ? last - 1 : base;
+			} else if (!absolute) {
+				if (out > base) *out++ = '/';
+				*out++ = '.';
+				*out++ = '.';
+			}
+		} else {
+			if (out > base) *out++ = '/';
+			memmove(out, p, len);
+			out += len;
+		}
+		p += len + (p[len] == '/');
+	}
+	if (out == path) *out++ = '.';
+	*out = '\0';
+}
+
+// FNV-1a, used for all of the string keyed tables
+unsigned long hash_string(const char* s) {
+	unsigned long h = HASH_INIT;
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211UL;
+	}
+	return h;
+}
+
+// FNV-1a again, continuing from h (HASH_INIT to start fresh)
+unsigned long hash_bytes(unsigned long h, const void* data, size_t len) {
+	const unsigned char* p = data;
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 1099511628211UL;
+	}
+	return h;
 }
 
-static const luaL_Reg bake_lib[] = {{"bake", l_bake},	{"recipe", l_recipe},
-									{"whisk", l_whisk}, {"yell", l_yell},
-									{"print", l_yell},	{NULL, NULL}};
+// Folds a file's contents into h. Files that can't be read count as a
+// marker instead, so they still differ from any contents.
+unsigned long hash_file(unsigned long h, const char* path) {
+	FILE* f = fopen(path, "rb");
+	if (!f) return hash_bytes(h, "\0missing", 9);
+
+	char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) h = hash_bytes(h, buf, n);
+	if (ferror(f)) h = hash_bytes(h, "\0unreadable", 12);
+	fclose(f);
+	return h;
+}
+
+static const luaL_Reg bake_lib[] = {{"recipe", l_recipe},
+									{"test", l_test},
+									{"whisk", l_whisk},
+									{"yell", l_yell},
+									{"print", l_yell},
+									{NULL, NULL}};
 
 BakeOptions args;
+char project_root[PATH_MAX];
+
+static double start_time = 0;
+static double eval_start = 0;
+
+// Failed builds exit from deep inside the walk, and they are the runs CI
+// wants numbers for the most, so this also runs at exit
+static void stats_report(void) {
+	static int reported = 0;
+	if (reported) return;
+	reported = 1;
+
+	cache_finish();	 // failed builds skip the one in l_bake
+	double now = now_seconds();
+	if (eval_start && !stats.eval_time) stats.eval_time = now - eval_start;
+	stats.total_time = now - start_time;
+
+	if (args.stats) stats_print();
+	if (args.stats_json && !stats_write_json(args.stats_json)) {
+		print("\x1b[31mCould not write statistics to %s\x1b[0m",
+			  args.stats_json);
+	}
+	if (args.metrics_file && !stats_write_metrics(args.metrics_file)) {
+		print("\x1b[31mCould not write metrics to %s\x1b[0m",
+			  args.metrics_file);
+	}
+}
 
 int main(int argc, char* argv[]) {
+	start_time = now_seconds();
 	args = parse_args(argc, argv);
+	log_init();
+	if (args.worker_socket) return worker_main(args.worker_socket);
+	if (args.cache_server) return cache_server_main(args.cache_server);
+	if (args.dir && chdir(args.dir) != 0) {
+		print("\x1b[31mCan't change into \"%s\": %s\x1b[0m", args.dir,
+			  strerror(errno));
+		return 1;
+	}
+	if (!getcwd(project_root, sizeof(project_root))) {
+		perror("getcwd");
+		return 1;
+	}
 
 	recipe_arr.data = NULL;
 	recipe_arr.count = 0;
 	recipe_arr.capacity = 0;
+	nodes_init();
+	state_load();
+	atexit(state_save);	 // failed builds still keep what they learned
+	atexit(stats_report);
+	if (args.trace && !trace_init()) return 1;
 
 	if (!exists(args.file)) {
 		print(
@@ -39,6 +211,18 @@ int main(int argc, char* argv[]) {
 		lua_pushcfunction(L, func->func);
 		lua_setglobal(L, func->name);  // sets the function as a global
 	}
+	lua_newtable(L);  // create bake table
+
+	lua_pushcfunction(L, l_include);
+	lua_setfield(L, -2, "include");	 // bake.include = l_include
+
+	lua_newtable(L);  // metatable
+	lua_pushcfunction(L, l_bake_call);
+	lua_setfield(L, -2, "__call");	// bake(goals) still builds
+	lua_setmetatable(L, -2);
+
+	lua_setglobal(L, "bake");
+
 	lua_newtable(L);  // create pantry table
 
 	lua_pushcfunction(L, l_buy);
@@ -65,15 +249,21 @@ int main(int argc, char* argv[]) {
 	lua_setmetatable(L, -2);		// set metatable for pantry table
 
 	lua_setglobal(L, "pantry");	 // set pantry table as global
+	eval_start = now_seconds();
 	if (luaL_loadfile(L, args.file) || lua_pcall(L, 0, 0, 0)) {
 		const char* err = lua_tostring(L, -1);
 		print("\x1b[31mError loading/executing %s: %s\x1b[0m", args.file, err);
 		lua_pop(L, 1);
+		stats_report();	 // while the graph is still around
+		state_save();
 		recipes_free(L);
 		lua_close(L);
 		return 1;
 	}
+	stats.eval_time = now_seconds() - eval_start;
+	stats_report();
 
+	state_save();
 	recipes_free(L);
 	lua_close(L);
 	return 0;
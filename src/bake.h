@@ -1,6 +1,7 @@
 #pragma once
 
 #include <lua5.3/lua.h>
+#include <sys/stat.h>
 
 // Lua functions
 
@@ -15,9 +16,13 @@ int l_pantry(lua_State* L);
 int l_is_shelf(lua_State* L);
 int l_collect(lua_State* L);
 int l_objects(lua_State* L);
+int l_include(lua_State* L);
+int l_bake_call(lua_State* L);
 
 // Argument parsing
 
+enum { LOG_TEXT, LOG_JSON };
+
 typedef struct {
 	int force;
 	const char* file;
@@ -25,27 +30,117 @@ typedef struct {
 	const char** targets;
 	int target_count;
 	int keep_defaults;
+	const char** affected;
+	int affected_count;
+	int stats;
+	const char* stats_json;
+	const char* metrics_file;
+	int log_format;
+	int jobs;
+	const char** workers;
+	int worker_count;
+	const char* worker_socket;	// run as a bake-worker daemon on this socket
+	int trace;
+	int progress;
+	int clean;
+	int prune;
+	int dry_run;
+	int explain;
+	const char* cache_url;	// shared artifact cache, see cache.c
+	const char* cache_server;  // serve one on this [host:]port instead
 } BakeOptions;
 
 BakeOptions parse_args(int argc, char** argv);
 extern BakeOptions args;
+extern char project_root[];	 // absolute, after -C
 
 // Logging
 
-void print(const char* fmt, ...);
+// Output of a job, collected while it runs and written out in one go
+typedef struct {
+	char* data;
+	size_t len;
+	size_t cap;
+} LogBuffer;
 
+void log_init(void);
+void print(const char* fmt, ...);
 int indent_log(int delta);
+void log_capture(LogBuffer* buf);  // NULL goes back to writing through
+void log_flush(LogBuffer* buf);
+void log_status(const char* line);	// redrawn in place below the log, or NULL
+void log_buffer_append(LogBuffer* buf, const char* data, size_t len);
+void log_buffer_free(LogBuffer* buf);
+
+// Arena
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+	ArenaBlock* head;
+	size_t bytes;
+} Arena;
+
+void* arena_alloc(Arena* a, size_t size);
+char* arena_strdup(Arena* a, const char* s);
+void arena_free(Arena* a);
+
+// Nodes (interned paths)
+
+#define NODE_ALWAYS 0
+
+// Node.stat_state, filled in lazily by node_stat
+enum { NODE_STAT_UNKNOWN, NODE_MISSING, NODE_FILE, NODE_DIR };
+
+typedef struct {
+	const char* path;
+	int recipe;	 // index into recipe_arr, -1 for plain files
+	int state;	 // index into state_arr, -1 if nothing is recorded
+	int stat_state;
+	time_t mtime;
+} Node;
+
+typedef struct {
+	Node* data;
+	size_t count;
+	size_t capacity;
+} NodeArray;
+
+extern Arena graph_arena;
+extern NodeArray node_arr;
+
+void nodes_init(void);
+int node_intern(const char* path);
+int node_lookup(const char* path);
+int node_stat(int id);
+void node_stat_invalidate(int id);
+size_t nodes_memory(void);
+void nodes_free(void);
+
+#define node_path(id) (node_arr.data[(id)].path)
 
 // Recipes
 
+// Recipe.state during a build walk
+enum { RECIPE_UNVISITED, RECIPE_VISITING, RECIPE_RUNNING, RECIPE_DONE };
+
 typedef struct Recipe {
-	char* target;
-	char** dependencies;
+	int target;	 // node ID, -1 for unexpanded wildcards
+	int* dependencies;	// node IDs, allocated in the graph arena
 	int deplen;
 	int function;
+	const char* command;  // shell command instead of a function, or NULL
 	int is_wildcard;
-	char* pattern_target;
-	char** pattern_deps;
+	int state;	// build walk state, see build.c
+	const char* pattern_target;
+	const char** pattern_deps;
+	const char* dir;  // sub-project it came from, NULL for the top level
+	int rebuilt;  // this run rebuilt it (or would have, with -n)
+	int failed;	 // a test that failed, or skipped because of one
+	int shards;	 // test recipes: jobs the suite is split into, else 0
+	double timeout;	 // test recipes: seconds per shard, 0 for none
+	int unity;	// pattern recipes: sources per unity group, 0 for none
+	unsigned long command_hash;	 // of the expanded command, 0 until needed
 } Recipe;
 
 typedef struct {
@@ -54,18 +149,183 @@ typedef struct {
 	size_t capacity;
 } RecipeArray;
 
+extern RecipeArray recipe_arr;
+
+void recipe_add(Recipe recipe);
+int pattern_fill(char* buf, size_t size, const char* pattern,
+				 const char* stem, size_t stem_len);
+// Why a target gets rebuilt, see is_out_of_date
+enum {
+	STALE_FRESH,
+	STALE_FORCED,  // -B
+	STALE_ALWAYS,
+	STALE_MISSING_OUTPUT,
+	STALE_MISSING_DEP,
+	STALE_NEWER_DEP,
+	STALE_COMMAND,	// the expanded shell command changed
+	STALE_DEP_REBUILT,	// -n only, a dependency would have been rebuilt
+};
+
+int is_out_of_date(Recipe* recipe, int* why_dep);
+Recipe* recipe_find(const char* target);
+size_t recipes_memory(void);
+void recipes_free(lua_State* L);
+
+// Reverse edges (node ID -> indices of recipes depending on it)
+
+void recipes_index_dependents(void);
+const size_t* recipe_dependents(int node, size_t* count);
+
+// Unity builds (pattern recipes compiled in groups)
+
+void unity_expand(const Recipe* pattern, const char* source_pattern,
+				  const char** stems, size_t count);
+void unity_substitute(void);
+
+// Sub-projects (bake.include)
+
+extern const char* include_dir;	 // sub-project being evaluated, or NULL
+const char* include_rebase(const char* path, char* buf, size_t size);
+const char* path_from(const char* dir, const char* path, char* buf,
+					  size_t size);
+
+// Persistent state (.bake/state), what earlier runs learned per target
+
+#define STATE_DIR ".bake"
+
+typedef struct {
+	int target;	 // node ID
+	int* discovered;  // inputs found by tracing, node IDs
+	int discovered_count;
+	double duration;  // seconds the recipe took when it last succeeded
+	time_t output_mtime;  // of the file Bake produced, 0 if it isn't one
+	unsigned long command_hash;	 // of the command it last ran, 0 if unknown
+	unsigned long test_pass;  // test recipes: key of the last passing run
+} StateEntry;
+
 typedef struct {
-	Recipe** data;
+	StateEntry* data;
 	size_t count;
 	size_t capacity;
-} RecipeArrayP;
+} StateArray;
 
-extern RecipeArray recipe_arr;
+extern StateArray state_arr;
 
-void recipe_add(Recipe recipe);
-Recipe* recipe_find(char* target);
-void recipes_free(lua_State* L);
+void state_load(void);
+void state_save(void);
+void state_free(void);
+StateEntry* state_get(int node);  // NULL if nothing is recorded
+StateEntry* state_entry(int node);	// creates the entry if needed
+void state_set_discovered(StateEntry* e, const int* deps, int count);
+void state_record_build(int target, double seconds,
+						unsigned long command_hash);
+void state_set_output(StateEntry* e, time_t mtime);
+void state_set_test_pass(StateEntry* e, unsigned long key);
+void state_forget(StateEntry* e);  // dropped from the file on the next save
+
+// File access tracing (--trace)
+
+int trace_init(void);
+char* trace_begin(void);  // fresh trace file path, NULL if tracing is off
+char* trace_wrap(const char* cmd, const char* trace_file);
+void trace_end(Recipe* recipe, char* trace_file);
+extern const char* trace_current;  // trace file for whisk, set by build
+
+// Scheduler (shell command recipes run as jobs, locally or on workers)
+
+void scheduler_submit(size_t recipe, int shard);
+void scheduler_wait(const Recipe* recipe);
+void scheduler_finish(void);
+char* command_expand(const Recipe* recipe);
+
+// Artifact cache (--cache, shared over HTTP)
+
+int cache_key(const Recipe* recipe, const char* command,
+			  unsigned long key[2]);  // 0 if the recipe can't be cached
+int cache_fetch(const unsigned long key[2], const char* target);
+void cache_upload(const unsigned long key[2], const char* target);
+void cache_finish(void);
+int cache_server_main(const char* address);
+
+// Progress (status line with an ETA)
+
+void progress_plan(const char* target);	 // counts what building it will run
+void progress_start(void);
+void progress_begin(size_t recipe);
+void progress_end(size_t recipe);
+void progress_stop(void);
+
+// Test recipes
+
+int l_test(lua_State* L);
+void test_start(Recipe* recipe);
+char* test_command(const Recipe* recipe, int shard);
+void test_reap(size_t recipe, int shard, int exit_code, double seconds,
+			   const char* command, LogBuffer* log);
+int tests_summary(void);  // prints the table, returns the failure count
+
+// Workers
+
+int worker_main(const char* socket_path);
+int worker_connect(const char* socket_path);
+int worker_run_job(int fd, const char* dir, const char* command,
+				   const char** inputs, int input_count, const char** outputs,
+				   int output_count, LogBuffer* log, int* exit_code);
+
+// Statistics
+
+typedef struct {
+	double total_time;	 // whole run, from startup to teardown
+	double eval_time;	 // evaluating the bakefile, including bake()
+	double expand_time;	 // wildcard expansion
+	double build_time;	 // walking the graph and running recipes
+	double collect_time;  // pantry.collect
+	double recipe_time;	  // inside recipe functions, children included
+	double child_time;	  // waiting on whisk'd processes
+	double job_wait_time;  // build walk blocked on command jobs
+	long stat_calls;
+	long stat_cache_hits;
+	long targets_checked;
+	long targets_built;
+	long targets_fresh;
+	long spawns;  // whisk and local jobs
+	long output_bytes;	// command output captured by whisk
+	long whisk_cache_hits;	// whisk(cmd, {cache = ...}) results replayed
+	long whisk_cache_misses;
+	long cache_hits;  // command recipes served from the artifact cache
+	long cache_misses;
+	long cache_uploads;
+} BakeStats;
+
+extern BakeStats stats;
+
+double now_seconds(void);
+long peak_rss_kib(void);
+void stats_print(void);
+int stats_write_json(const char* path);
+int stats_write_metrics(const char* path);
+
+// Queries
+
+void print_affected(const char** files, int count);
+
+// Cleaning (--clean and --prune, driven by the output manifest)
+
+void clean_collect(const char* target);
+void prune_collect(void);
+void clean_remove(void);
 
 // Utility functions
 
+int bake_stat(const char* path, struct stat* st);
 int exists(const char* fname);
+int mkdir_parents(const char* path);
+char* read_file(const char* path, size_t* len);
+void normalize_path(char* path);
+#define RUN_TIMED_OUT (-1)
+int run_command(const char* cmd, const char* dir, double timeout,
+				LogBuffer* output);
+#define HASH_INIT 14695981039346656037UL
+unsigned long hash_string(const char* s);
+unsigned long hash_bytes(unsigned long h, const void* data, size_t len);
+unsigned long hash_file(unsigned long h, const char* path);
@@ -1,5 +1,6 @@
 #include <dirent.h>
-#include <libgen.h>
+#include <errno.h>
+#include <limits.h>
 #include <lua5.3/lauxlib.h>
 #include <lua5.3/lua.h>
 #include <stdbool.h>
@@ -7,258 +8,476 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "bake.h"
 
-static RecipeArrayP visited = {NULL, 0, 0};
-
-int is_out_of_date(const char* target, char** deps, int deplen) {
-	struct stat st_target;
-	int target_exists = (stat(target, &st_target) == 0);
-	time_t target_mtime = target_exists ? st_target.st_mtime : 0;
-
-	for (int i = 0; i < deplen; i++) {
-		const char* dep = deps[i];
+// Returns why recipe's target needs rebuilding, STALE_FRESH if it doesn't.
+// why_dep (if not NULL) is set to the dependency behind STALE_MISSING_DEP
+// and STALE_NEWER_DEP.
+int is_out_of_date(Recipe* recipe, int* why_dep) {
+	int target = recipe->target;
+	const int* deps = recipe->dependencies;
+	int target_exists = node_stat(target) != NODE_MISSING;
+	time_t target_mtime = target_exists ? node_arr.data[target].mtime : 0;
+	int unused;
+	if (!why_dep) why_dep = &unused;
 
+	for (int i = 0; i < recipe->deplen; i++) {
 		// Special dependency that always forces rebuild
-		if (strcmp(dep, "ALWAYS") == 0) {
-			return 1;
+		if (deps[i] == NODE_ALWAYS) {
+			return STALE_ALWAYS;
 		}
 
-		struct stat st_dep;
-		if (stat(dep, &st_dep) != 0) {
+		int dep_state = node_stat(deps[i]);
+		if (dep_state == NODE_MISSING) {
 			// Missing dependency -> assume target is out-of-date
-			return 1;
+			*why_dep = deps[i];
+			return STALE_MISSING_DEP;
 		}
 
 		// Skip directories
-		if (S_ISDIR(st_dep.st_mode)) {
+		if (dep_state == NODE_DIR) {
 			continue;
 		}
 
-		// If target does not exist or dependency is newer
-		if (!target_exists || st_dep.st_mtime > target_mtime) {
-			return 1;
+		if (!target_exists) return STALE_MISSING_OUTPUT;
+		if (node_arr.data[deps[i]].mtime > target_mtime) {
+			*why_dep = deps[i];
+			return STALE_NEWER_DEP;
 		}
 	}
 
-	// All dependencies older than target -> up-to-date
-	return 0;
-}
-
-void expand_wildcard_recipes(lua_State* L) {
-	const char* target_suffix = ".o";
-
-	for (int i = 0; i < recipe_arr.count; i++) {
-		Recipe* wildcard_recipe = &recipe_arr.data[i];
-		if (!wildcard_recipe->is_wildcard) continue;
-
-		const char* pattern_target =
-			wildcard_recipe->pattern_target;  // e.g., build/%.o
-
-		for (int d = 0; d < wildcard_recipe->deplen; d++) {
-			const char* pattern_dep =
-				wildcard_recipe->pattern_deps[d];  // e.g., src/%.c
+	// Inputs an earlier --trace run caught the recipe reading
+	StateEntry* state = state_get(target);
+	for (int i = 0; state && i < state->discovered_count; i++) {
+		int dep = state->discovered[i];
+		*why_dep = dep;
+		if (node_stat(dep) != NODE_FILE) return STALE_MISSING_DEP;
+		if (!target_exists) return STALE_MISSING_OUTPUT;
+		if (node_arr.data[dep].mtime > target_mtime) return STALE_NEWER_DEP;
+	}
 
-			char* dep_copy = strdup(pattern_dep);
-			if (!dep_copy) continue;
+	// Same command as last time? Older states don't know, that's no reason.
+	// Expanded once, the plan walk and the build walk both ask.
+	if (recipe->command && state && state->command_hash) {
+		if (!recipe->command_hash) {
+			char* cmd = command_expand(recipe);
+			if (cmd) recipe->command_hash = hash_string(cmd);
+			free(cmd);
+		}
+		if (recipe->command_hash &&
+			recipe->command_hash != state->command_hash)
+			return STALE_COMMAND;
+	}
 
-			const char* dir = dirname(dep_copy);  // scan this dir
-			DIR* dir_stream = opendir(dir);
-			free(dep_copy);
-			if (!dir_stream) continue;
+	// All dependencies older than target -> up-to-date
+	return STALE_FRESH;
+}
 
-			struct dirent* entry;
-			size_t dep_suffix_len = strlen(
-				strrchr(pattern_dep, '.') ? strrchr(pattern_dep, '.') : "");
+static const char* format_mtime(char* buf, size_t size, int node) {
+	struct tm tm;
+	time_t t = node_arr.data[node].mtime;
+	if (!localtime_r(&t, &tm) || !strftime(buf, size, "%F %T", &tm))
+		snprintf(buf, size, "%lld", (long long)t);
+	return buf;
+}
 
-			while ((entry = readdir(dir_stream)) != NULL) {
-				if (entry->d_type != DT_REG) continue;
+// --explain: one line on why target gets rebuilt
+static void explain(const Recipe* recipe, int reason, int dep) {
+	const char* target = node_path(recipe->target);
+	char dep_time[32], target_time[32];
+	switch (reason) {
+		case STALE_FORCED:
+			print("\x1b[36m\"%s\": forced by -B\x1b[0m", target);
+			break;
+		case STALE_ALWAYS:
+			print("\x1b[36m\"%s\": depends on ALWAYS\x1b[0m", target);
+			break;
+		case STALE_MISSING_OUTPUT:
+			print("\x1b[36m\"%s\": output doesn't exist\x1b[0m", target);
+			break;
+		case STALE_MISSING_DEP:
+			print("\x1b[36m\"%s\": dependency \"%s\" doesn't exist\x1b[0m",
+				  target, node_path(dep));
+			break;
+		case STALE_NEWER_DEP:
+			print(
+				"\x1b[36m\"%s\": dependency \"%s\" (%s) is newer than the "
+				"output (%s)\x1b[0m",
+				target, node_path(dep),
+				format_mtime(dep_time, sizeof(dep_time), dep),
+				format_mtime(target_time, sizeof(target_time), recipe->target));
+			break;
+		case STALE_COMMAND:
+			print("\x1b[36m\"%s\": command changed since the last build\x1b[0m",
+				  target);
+			break;
+		case STALE_DEP_REBUILT:
+			print("\x1b[36m\"%s\": dependency \"%s\" would be rebuilt\x1b[0m",
+				  target, node_path(dep));
+			break;
+	}
+}
 
-				const char* filename = entry->d_name;
-				size_t name_len = strlen(filename);
-				if (name_len <= dep_suffix_len) continue;  // too short
+// -n: nothing runs, so dependents of what would be rebuilt have to be
+// rebuilt on their word rather than by their mtimes
+static int dep_rebuilt(const Recipe* recipe, int* why_dep) {
+	StateEntry* state = state_get(recipe->target);
+	int discovered = state ? state->discovered_count : 0;
+	for (int i = 0; i < recipe->deplen + discovered; i++) {
+		int dep = i < recipe->deplen ? recipe->dependencies[i]
+									 : state->discovered[i - recipe->deplen];
+		int idx = node_arr.data[dep].recipe;
+		if (idx >= 0 && recipe_arr.data[idx].rebuilt) {
+			*why_dep = dep;
+			return STALE_DEP_REBUILT;
+		}
+	}
+	return STALE_FRESH;
+}
 
-				// check if filename ends with same suffix as pattern_dep
-				if (dep_suffix_len > 0 &&
-					strcmp(filename + name_len - dep_suffix_len,
-						   pattern_dep + strlen(pattern_dep) -
-							   dep_suffix_len) != 0)
-					continue;
+// Writes pattern with its '%' replaced by stem into buf, 0 if it won't fit.
+int pattern_fill(char* buf, size_t size, const char* pattern,
+				 const char* stem, size_t stem_len) {
+	const char* pct = strchr(pattern, '%');
+	if (!pct) return snprintf(buf, size, "%s", pattern) < (int)size;
+	int n = snprintf(buf, size, "%.*s%.*s%s", (int)(pct - pattern), pattern,
+					 (int)stem_len, stem, pct + 1);
+	return n >= 0 && (size_t)n < size;
+}
 
-				// compute stem dynamically
-				size_t stem_len = name_len - dep_suffix_len;
-				char* stem = malloc(stem_len + 1);
-				if (!stem) continue;
-				strncpy(stem, filename, stem_len);
-				stem[stem_len] = '\0';
-
-				// build concrete target and dependency paths
-				size_t tgt_len =
-					strlen("build/") + stem_len + strlen(target_suffix) + 1;
-				char* concrete_target = malloc(tgt_len);
-				if (!concrete_target) {
-					free(stem);
-					continue;
+void expand_wildcard_recipes(void) {
+	char path[PATH_MAX];
+
+	// recipe_add may move the array, so only hold indices across it
+	size_t count = recipe_arr.count;
+	for (size_t i = 0; i < count; i++) {
+		if (!recipe_arr.data[i].is_wildcard) continue;
+		Recipe wildcard_recipe = recipe_arr.data[i];
+		recipe_arr.data[i].is_wildcard = false;	 // mark as expanded
+
+		// stems come from the first dependency with a '%' in it,
+		// e.g. build/%.o <- src/%.c scans src/ for "*.c"
+		const char* pattern_dep = NULL;
+		for (int d = 0; d < wildcard_recipe.deplen; d++) {
+			if (strchr(wildcard_recipe.pattern_deps[d], '%')) {
+				pattern_dep = wildcard_recipe.pattern_deps[d];
+				break;
+			}
+		}
+		if (!pattern_dep) continue;
+
+		const char* base = strrchr(pattern_dep, '/');
+		base = base ? base + 1 : pattern_dep;
+		const char* pct = strchr(base, '%');
+		if (!pct) continue;	 // '%' in the directory part isn't supported
+		size_t prefix_len = pct - base;
+		size_t suffix_len = strlen(pct + 1);
+
+		if (base == pattern_dep) {
+			snprintf(path, sizeof(path), ".");
+		} else {
+			snprintf(path, sizeof(path), "%.*s", (int)(base - pattern_dep - 1),
+					 pattern_dep);
+		}
+		DIR* dir_stream = opendir(path);
+		if (!dir_stream) continue;
+
+		// unity patterns collect their stems to be grouped afterwards
+		const char** stems = NULL;
+		size_t stem_count = 0, stem_cap = 0;
+
+		struct dirent* entry;
+		while ((entry = readdir(dir_stream)) != NULL) {
+			if (entry->d_type != DT_REG) continue;
+
+			const char* filename = entry->d_name;
+			size_t name_len = strlen(filename);
+			if (name_len <= prefix_len + suffix_len) continue;	// too short
+			if (strncmp(filename, base, prefix_len) != 0) continue;
+			if (strcmp(filename + name_len - suffix_len, pct + 1) != 0)
+				continue;
+
+			const char* stem = filename + prefix_len;
+			size_t stem_len = name_len - prefix_len - suffix_len;
+
+			if (wildcard_recipe.unity) {
+				if (stem_count == stem_cap) {
+					stem_cap = stem_cap ? stem_cap * 2 : 64;
+					const char** tmp =
+						realloc(stems, stem_cap * sizeof(*stems));
+					if (!tmp) {
+						perror("realloc");
+						exit(EXIT_FAILURE);
+					}
+					stems = tmp;
 				}
-				snprintf(concrete_target, tgt_len, "build/%s%s", stem,
-						 target_suffix);
-
-				size_t dep_len = strlen("src/") + stem_len + dep_suffix_len + 1;
-				char* concrete_dep = malloc(dep_len);
-				if (!concrete_dep) {
-					free(stem);
-					free(concrete_target);
+				char* copy = arena_alloc(&graph_arena, stem_len + 1);
+				memcpy(copy, stem, stem_len);
+				copy[stem_len] = '\0';
+				stems[stem_count++] = copy;
+				continue;
+			}
+
+			if (!pattern_fill(path, sizeof(path),
+							  wildcard_recipe.pattern_target, stem, stem_len))
+				continue;
+
+			Recipe new_recipe = {0};
+			new_recipe.target = node_intern(path);
+			new_recipe.dependencies = arena_alloc(
+				&graph_arena, wildcard_recipe.deplen * sizeof(int));
+			new_recipe.deplen = 0;
+			for (int d = 0; d < wildcard_recipe.deplen; d++) {
+				if (!pattern_fill(path, sizeof(path),
+								  wildcard_recipe.pattern_deps[d], stem,
+								  stem_len))
 					continue;
-				}
-				const char* dep_suffix =
-					pattern_dep + strlen(pattern_dep) - dep_suffix_len;
-				snprintf(concrete_dep, dep_len, "src/%s%s", stem, dep_suffix);
-
-				// create new recipe
-				Recipe new_recipe;
-				new_recipe.target = concrete_target;
-				new_recipe.dependencies = malloc(sizeof(char*));
-				new_recipe.dependencies[0] = concrete_dep;
-				new_recipe.deplen = 1;
-				new_recipe.function = wildcard_recipe->function;
-				new_recipe.is_wildcard = false;
-				new_recipe.pattern_target = NULL;
-				new_recipe.pattern_deps = NULL;
-
-				recipe_add(new_recipe);
-				free(stem);
+				new_recipe.dependencies[new_recipe.deplen++] =
+					node_intern(path);
 			}
-			closedir(dir_stream);
+			new_recipe.function = wildcard_recipe.function;
+			new_recipe.command = wildcard_recipe.command;
+			new_recipe.is_wildcard = false;
+			new_recipe.pattern_target = wildcard_recipe.pattern_target;
+			new_recipe.pattern_deps = wildcard_recipe.pattern_deps;
+			new_recipe.dir = wildcard_recipe.dir;
+
+			recipe_add(new_recipe);
 		}
-
-		wildcard_recipe->is_wildcard = false;  // mark as expanded
+		closedir(dir_stream);
+		unity_expand(&wildcard_recipe, pattern_dep, stems, stem_count);
+		free(stems);
 	}
+	unity_substitute();
 }
 
-void build_cleanup() {
-	if (!visited.data) return;
-	for (int i = 0; i < visited.count; i++) {
-		free(visited.data[i]->target);
-		free(visited.data[i]);
-	}
-	free(visited.data);
-	visited.data = NULL;
-	visited.count = visited.capacity = 0;
+// The i'th dependency, declared ones first and then discovered ones. The
+// state entry is looked up every time: building a dependency records state
+// and may move state_arr.
+static int dependency_at(const Recipe* recipe, int i) {
+	if (i < recipe->deplen) return recipe->dependencies[i];
+	return state_get(recipe->target)->discovered[i - recipe->deplen];
 }
 
-void build(lua_State* L, const char* target) {
-	if (!target || target[0] == '\0') {
-		print("ERR: Empty string passed to build");
+static void build_recipe(lua_State* L, Recipe* recipe) {
+	if (recipe->state == RECIPE_DONE || recipe->state == RECIPE_RUNNING) return;
+	if (recipe->state == RECIPE_VISITING) {
+		print("\x1b[33mWarning: dependency cycle through \"%s\"\x1b[0m",
+			  node_path(recipe->target));
 		return;
 	}
-
-	Recipe* recipe = recipe_find((char*)target);
-	if (!recipe) return;
-
-	// Prevent cycles: check visited first
-	for (int i = 0; i < visited.count; i++) {
-		if (strcmp(visited.data[i]->target, target) == 0) return;
+	recipe->state = RECIPE_VISITING;
+
+	// Recursively build dependencies first, discovered ones included
+	StateEntry* state = state_get(recipe->target);
+	int discovered = state ? state->discovered_count : 0;
+	for (int i = 0; i < recipe->deplen + discovered; i++) {
+		int dep = dependency_at(recipe, i);
+		if (dep == NODE_ALWAYS) continue;
+		int idx = node_arr.data[dep].recipe;
+		if (idx >= 0) build_recipe(L, &recipe_arr.data[idx]);
 	}
 
-	// Recursively build dependencies first
-	for (int i = 0; i < recipe->deplen; i++) {
-		const char* dep = recipe->dependencies[i];
-		if (strcmp(dep, "ALWAYS") != 0) {
-			build(L, dep);
-		}
+	// dependencies may still be baking as jobs
+	for (int i = 0; i < recipe->deplen + discovered; i++) {
+		int dep = dependency_at(recipe, i);
+		int idx = node_arr.data[dep].recipe;
+		if (idx >= 0) scheduler_wait(&recipe_arr.data[idx]);
+	}
+	recipe->state = RECIPE_DONE;
+
+	// a failed test stops what depends on it, the rest carries on
+	for (int i = 0; i < recipe->deplen + discovered; i++) {
+		int dep = dependency_at(recipe, i);
+		int idx = node_arr.data[dep].recipe;
+		if (idx < 0 || !recipe_arr.data[idx].failed) continue;
+		print("\x1b[33mSkipping \x1b[35m\"%s\"\x1b[33m, \"%s\" %s\x1b[0m",
+			  node_path(recipe->target), node_path(dep),
+			  recipe_arr.data[idx].shards ? "failed" : "was skipped");
+		recipe->failed = 1;
+		return;
+	}
+	if (recipe->shards) {
+		test_start(recipe);
+		return;
 	}
 
-	if (!args.force &&
-		!is_out_of_date(recipe->target, recipe->dependencies, recipe->deplen)) {
+	const char* target = node_path(recipe->target);
+	stats.targets_checked++;
+	int why_dep = -1;
+	int reason = args.force ? STALE_FORCED : STALE_FRESH;
+	if (!reason && args.dry_run) reason = dep_rebuilt(recipe, &why_dep);
+	if (!reason) reason = is_out_of_date(recipe, &why_dep);
+	if (!reason) {
 		print("\x1b[35m\"%s\"\x1b[32m is fresh, serving...\x1b[0m", target);
+		stats.targets_fresh++;
 		return;
 	}
-
-	// Add recipe to visited safely
-	if (visited.count >= visited.capacity) {
-		size_t new_cap = visited.capacity ? visited.capacity * 2 : 8;
-		Recipe** tmp = realloc(visited.data, new_cap * sizeof(*visited.data));
-		if (!tmp) {
-			perror("realloc");
-			build_cleanup();
-			exit(EXIT_FAILURE);
+	stats.targets_built++;
+	recipe->rebuilt = 1;
+	if (args.explain) explain(recipe, reason, why_dep);
+
+	if (args.dry_run) {
+		print("\x1b[34mWould bake recipe \x1b[35m\"%s\"\x1b[0m", target);
+		char* cmd = recipe->command ? command_expand(recipe) : NULL;
+		if (cmd) {
+			indent_log(1);
+			print("\x1b[2;90m$ %s\x1b[0m", cmd);
+			indent_log(-1);
 		}
-		visited.data = tmp;
-		visited.capacity = new_cap;
+		free(cmd);
+		return;
 	}
 
-	Recipe* copy = malloc(sizeof(Recipe));
-	if (!copy) {
-		perror("malloc");
-		build_cleanup();
-		exit(EXIT_FAILURE);
-	}
-	*copy = *recipe;
-	copy->target = strdup(recipe->target);
-	if (!copy->target) {
-		perror("strdup");
-		free(copy);
-		build_cleanup();
-		exit(EXIT_FAILURE);
+	if (recipe->command) {
+		scheduler_submit(recipe - recipe_arr.data, 0);
+		return;
 	}
-	visited.data[visited.count++] = copy;
 
-	// Push Lua function and arguments
+	// Push Lua function and arguments, as seen from the recipe's directory
+	char rel[PATH_MAX];
 	lua_rawgeti(L, LUA_REGISTRYINDEX, recipe->function);
-	lua_pushstring(L, target);
+	lua_pushstring(L, path_from(recipe->dir, target, rel, sizeof(rel)));
 
 	lua_newtable(L);
 	for (int i = 0; i < recipe->deplen; i++) {
-		lua_pushstring(L, recipe->dependencies[i]);
+		const char* dep = node_path(recipe->dependencies[i]);
+		if (recipe->dependencies[i] != NODE_ALWAYS)
+			dep = path_from(recipe->dir, dep, rel, sizeof(rel));
+		lua_pushstring(L, dep);
 		lua_rawseti(L, -2, i + 1);
 	}
 
 	print("\x1b[34mBaking recipe \x1b[35m\"%s\"\x1b[0m", target);
 	indent_log(1);
-	if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+	char* trace_file = trace_begin();
+	trace_current = trace_file;
+	if (recipe->dir && chdir(recipe->dir) != 0) {
+		print("\x1b[31mCan't enter \"%s\": %s\x1b[0m", recipe->dir,
+			  strerror(errno));
+		scheduler_finish();
+		exit(EXIT_FAILURE);
+	}
+	size_t idx = recipe - recipe_arr.data;
+	progress_begin(idx);
+	double start = now_seconds();
+	int status = lua_pcall(L, 2, 1, 0);
+	double elapsed = now_seconds() - start;
+	stats.recipe_time += elapsed;
+	progress_end(idx);
+	if (recipe->dir && chdir(project_root) != 0) {
+		perror("chdir");
+		exit(EXIT_FAILURE);
+	}
+	trace_current = NULL;
+	node_stat_invalidate(recipe->target);
+	trace_end(recipe, trace_file);
+	if (status != LUA_OK) {
 		const char* err = lua_tostring(L, -1);
 		print("\x1b[31mError calling function: %s\x1b[0m", err);
 		indent_log(-1);
 		lua_pop(L, 1);
-		build_cleanup();
+		scheduler_finish();
 		exit(EXIT_FAILURE);
 	}
+	state_record_build(recipe->target, elapsed, 0);
 	indent_log(-1);
 	lua_pop(L, 1);
 }
 
-int l_bake(lua_State* L) {
-	if (!lua_istable(L, 1)) {
-		return luaL_error(L, "Expected table as argument.");
+void build(lua_State* L, const char* target) {
+	if (!target || target[0] == '\0') {
+		print("ERR: Empty string passed to build");
+		return;
 	}
-	expand_wildcard_recipes(L);
 
-	lua_pushnil(L);
-	print("\x1b[33mBaking...\x1b[0m");
-	if (args.target_count == 0 || args.keep_defaults == 1) {
+	Recipe* recipe = recipe_find(target);
+	if (!recipe) return;
+	build_recipe(L, recipe);
+}
+
+// The goals of this run: the bakefile's defaults unless targets were given
+// on the command line (or -d keeps them). The strings stay in the table and
+// in argv for as long as the build runs.
+static const char** collect_goals(lua_State* L, int* count) {
+	int defaults = args.target_count == 0 || args.keep_defaults == 1;
+	int cap = args.target_count;
+	if (defaults) {
+		lua_pushnil(L);
 		while (lua_next(L, 1) != 0) {
-			if (lua_type(L, -1) == LUA_TSTRING) {
-				indent_log(1);
-				const char* value = lua_tostring(L, -1);
-				build(L, value);
-				indent_log(-1);
-			}
+			cap++;
 			lua_pop(L, 1);
 		}
 	}
-	// forgive me for this warcrime.
-	if (args.target_count >= 1) {
-		for (int i = 0; i < args.target_count; i++) {
-			indent_log(1);
-			build(L, args.targets[i]);
-			indent_log(-1);
+
+	const char** goals = arena_alloc(&graph_arena, cap * sizeof(*goals));
+	int n = 0;
+	if (defaults) {
+		lua_pushnil(L);
+		while (lua_next(L, 1) != 0) {
+			if (lua_type(L, -1) == LUA_TSTRING)
+				goals[n++] = lua_tostring(L, -1);
+			lua_pop(L, 1);
 		}
 	}
+	for (int i = 0; i < args.target_count; i++) goals[n++] = args.targets[i];
+	*count = n;
+	return goals;
+}
+
+static void reset_walk(void) {
+	for (size_t i = 0; i < recipe_arr.count; i++) {
+		recipe_arr.data[i].state = RECIPE_UNVISITED;
+		recipe_arr.data[i].rebuilt = 0;
+		recipe_arr.data[i].failed = 0;
+	}
+}
+
+int l_bake(lua_State* L) {
+	if (!lua_istable(L, 1)) {
+		return luaL_error(L, "Expected table as argument.");
+	}
+	double start = now_seconds();
+	expand_wildcard_recipes();
+	stats.expand_time += now_seconds() - start;
+	reset_walk();
+
+	if (args.affected) {
+		print_affected(args.affected, args.affected_count);
+		return 0;
+	}
 
-	build_cleanup();
+	int goal_count;
+	const char** goals = collect_goals(L, &goal_count);
+	if (args.clean || args.prune) {
+		if (args.clean)
+			for (int i = 0; i < goal_count; i++) clean_collect(goals[i]);
+		if (args.prune) prune_collect();
+		clean_remove();
+		return 0;
+	}
+
+	start = now_seconds();
+	for (int i = 0; i < goal_count; i++) progress_plan(goals[i]);
+	reset_walk();
+	progress_start();
+
+	print("\x1b[33mBaking...\x1b[0m");
+	for (int i = 0; i < goal_count; i++) {
+		indent_log(1);
+		build(L, goals[i]);
+		indent_log(-1);
+	}
 
+	scheduler_finish();
+	progress_stop();
+	cache_finish();
+	stats.build_time += now_seconds() - start;
+	// a red test run is no broken bakefile, so not a Lua error either
+	if (tests_summary() > 0) exit(EXIT_FAILURE);
 	print("\x1b[33mCake is finished.\x1b[0m");
 	return 0;
 }
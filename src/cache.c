@@ -0,0 +1,616 @@
+#define _GNU_SOURCE	 // strcasestr, SOCK_CLOEXEC
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bake.h"
+
+// --cache http://host:port[/prefix] shares command recipe outputs between
+// machines. An artifact is stored under a key hashed from the command, the
+// directory it runs in, its target and the paths and contents of all of its
+// inputs (traced ones included), so it is only ever reused for the exact same
+// job. The protocol is plain HTTP: GET <prefix>/<key> returns the artifact or
+// 404, PUT <prefix>/<key> stores it. Artifacts are "bake-artifact 1 <mode>\n"
+// followed by the file's contents.
+//
+// Fetches happen on the job's thread and uploads on a thread of their own.
+// Every request has a short deadline, and the first one that fails or only
+// just makes it turns the cache off for the rest of the run, so a slow cache
+// costs at most a few seconds. bake --cache-server [host:]port is a small
+// reference server that keeps artifacts in the current directory.
+
+#define CACHE_GET_TIMEOUT 2.0
+#define CACHE_GET_SLOW 1.0	// an answer later than this counts as a failure
+#define CACHE_PUT_TIMEOUT 10.0
+#define CACHE_DRAIN_TIMEOUT 10.0  // for uploads still queued at the end
+#define CACHE_MAX_BODY (1UL << 30)
+#define CACHE_MAGIC "bake-artifact 1"
+
+static char host[256];
+static char port[16];
+static char prefix[PATH_MAX];
+static int parsed = 0;
+static int broken = 0;	// set once, read by every thread
+
+// Node ID -> content hash, filled in on the main thread as keys need them
+static unsigned long* content = NULL;
+static char* content_known = NULL;
+static size_t content_count = 0;
+
+static int parse_url(const char* url) {
+	if (strncmp(url, "http://", 7) != 0) return 0;
+	const char* h = url + 7;
+	size_t host_len = strcspn(h, ":/");
+	if (host_len == 0 || host_len >= sizeof(host)) return 0;
+	snprintf(host, sizeof(host), "%.*s", (int)host_len, h);
+
+	const char* p = h + host_len;
+	snprintf(port, sizeof(port), "80");
+	if (*p == ':') {
+		size_t port_len = strcspn(++p, "/");
+		if (port_len == 0 || port_len >= sizeof(port)) return 0;
+		snprintf(port, sizeof(port), "%.*s", (int)port_len, p);
+		p += port_len;
+	}
+	// without the trailing slash, keys are appended with one
+	snprintf(prefix, sizeof(prefix), "%s", p);
+	size_t len = strlen(prefix);
+	while (len > 0 && prefix[len - 1] == '/') prefix[--len] = '\0';
+	return 1;
+}
+
+static int cache_usable(void) {
+	if (!args.cache_url || __atomic_load_n(&broken, __ATOMIC_RELAXED))
+		return 0;
+	if (!parsed) {
+		parsed = 1;
+		if (!parse_url(args.cache_url)) {
+			print("\x1b[33mWarning: can't use cache %s, expected "
+				  "http://host[:port][/path]\x1b[0m",
+				  args.cache_url);
+			broken = 1;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void cache_fail(const char* why) {
+	if (__atomic_exchange_n(&broken, 1, __ATOMIC_RELAXED)) return;
+	print("\x1b[33mWarning: cache %s %s, building without it\x1b[0m",
+		  args.cache_url, why);
+}
+
+// HTTP
+
+static int wait_fd(int fd, short events, double deadline) {
+	for (;;) {
+		double left = deadline - now_seconds();
+		if (left <= 0) return 0;
+		struct pollfd pfd = {fd, events, 0};
+		int n = poll(&pfd, 1, (int)(left * 1000) + 1);
+		if (n > 0) return 1;
+		if (n < 0 && errno != EINTR) return 0;
+	}
+}
+
+static int send_until(int fd, const char* data, size_t len, double deadline) {
+	while (len > 0) {
+		if (!wait_fd(fd, POLLOUT, deadline)) return 0;
+		ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN) continue;
+			return 0;
+		}
+		data += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int connect_until(const char* h, const char* p, double deadline) {
+	struct addrinfo hints = {0};
+	struct addrinfo* res;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(h, p, &hints, &res) != 0) return -1;
+
+	int fd = -1;
+	for (struct addrinfo* ai = res; ai && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family,
+					ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+					ai->ai_protocol);
+		if (fd < 0) continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+
+		int err = errno;
+		socklen_t len = sizeof(err);
+		if (err == EINPROGRESS && wait_fd(fd, POLLOUT, deadline) &&
+			getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && !err)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+// Sends one request and leaves the response body in response. Returns the
+// status code, or 0 if the server couldn't be reached in time.
+static int http_request(const char* method, const char* key, const char* body,
+						size_t body_len, LogBuffer* response,
+						double timeout) {
+	double deadline = now_seconds() + timeout;
+	int fd = connect_until(host, port, deadline);
+	if (fd < 0) return 0;
+
+	char head[PATH_MAX + 512];
+	int head_len = snprintf(head, sizeof(head),
+							"%s %s/%s HTTP/1.1\r\nHost: %s:%s\r\n"
+							"Content-Length: %zu\r\nConnection: close\r\n\r\n",
+							method, prefix, key, host, port, body_len);
+	int ok = head_len > 0 && (size_t)head_len < sizeof(head) &&
+			 send_until(fd, head, head_len, deadline) &&
+			 send_until(fd, body, body_len, deadline);
+
+	// Connection: close, so the response ends where the stream does
+	char buf[65536];
+	while (ok) {
+		if (!wait_fd(fd, POLLIN, deadline)) {
+			ok = 0;
+			break;
+		}
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+		if (n <= 0) {
+			ok = n == 0;
+			break;
+		}
+		log_buffer_append(response, buf, n);
+		if (response->len > CACHE_MAX_BODY) ok = 0;
+	}
+	close(fd);
+	log_buffer_append(response, "", 1);
+	response->len--;
+	if (!ok) return 0;
+
+	int status = 0;
+	char* end = strstr(response->data, "\r\n\r\n");
+	if (!end || sscanf(response->data, "HTTP/%*s %d", &status) != 1)
+		return 0;
+	*end = '\0';
+	size_t header_len = end + 4 - response->data;
+	size_t length = response->len - header_len;
+	const char* cl = strcasestr(response->data, "\r\nContent-Length:");
+	if (cl && strtoul(cl + 17, NULL, 10) != length) return 0;  // cut short
+
+	memmove(response->data, response->data + header_len, length + 1);
+	response->len = length;
+	return status;
+}
+
+// Keys
+
+static unsigned long content_hash(int node) {
+	if ((size_t)node >= content_count) {
+		size_t count = node_arr.count;
+		unsigned long* c = realloc(content, count * sizeof(*c));
+		if (c) content = c;
+		char* k = realloc(content_known, count);
+		if (k) content_known = k;
+		if (!c || !k) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		memset(content_known + content_count, 0, count - content_count);
+		content_count = count;
+	}
+	if (!content_known[node]) {
+		// inputs are built before anything that reads them is keyed
+		content[node] = hash_file(HASH_INIT, node_path(node));
+		content_known[node] = 1;
+	}
+	return content[node];
+}
+
+static void fold(unsigned long key[2], const void* data, size_t len) {
+	key[0] = hash_bytes(key[0], data, len);
+	key[1] = hash_bytes(key[1], data, len);
+}
+
+// Two FNV-1a hashes with different starting points, 128 bits between them
+int cache_key(const Recipe* recipe, const char* command,
+			  unsigned long key[2]) {
+	if (!cache_usable() || recipe->shards) return 0;
+
+	key[0] = HASH_INIT;
+	key[1] = HASH_INIT ^ 0x9e3779b97f4a7c15UL;
+	fold(key, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	fold(key, command, strlen(command) + 1);
+	const char* dir = recipe->dir ? recipe->dir : "";
+	fold(key, dir, strlen(dir) + 1);
+	const char* target = node_path(recipe->target);
+	fold(key, target, strlen(target) + 1);
+
+	StateEntry* state = state_get(recipe->target);
+	int discovered = state ? state->discovered_count : 0;
+	for (int i = 0; i < recipe->deplen + discovered; i++) {
+		int dep = i < recipe->deplen ? recipe->dependencies[i]
+									 : state->discovered[i - recipe->deplen];
+		if (dep == NODE_ALWAYS) return 0;  // never the same job twice
+		const char* path = node_path(dep);
+		fold(key, path, strlen(path) + 1);
+		int kind = node_stat(dep);
+		fold(key, &kind, sizeof(kind));
+		if (kind == NODE_FILE) {
+			unsigned long h = content_hash(dep);
+			fold(key, &h, sizeof(h));
+		}
+	}
+	return 1;
+}
+
+// Fetching, on job threads
+
+static void key_name(char* buf, const unsigned long key[2]) {
+	snprintf(buf, 33, "%016lx%016lx", key[0], key[1]);
+}
+
+// Writes the artifact to target next to it first, a half written output
+// would look fresh to the next build
+static int unpack(const LogBuffer* artifact, const char* target) {
+	unsigned int mode;
+	int header = 0;
+	if (sscanf(artifact->data, CACHE_MAGIC " %o%n", &mode, &header) != 1 ||
+		artifact->data[header] != '\n')
+		return 0;
+	header++;
+
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	snprintf(path, sizeof(path), "%s/%s", project_root, target);
+	snprintf(tmp, sizeof(tmp), "%s.bake-cache", path);
+	if (!mkdir_parents(path)) return 0;
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode & 0777);
+	if (fd < 0) return 0;
+
+	const char* data = artifact->data + header;
+	size_t len = artifact->len - header;
+	int ok = 1;
+	while (ok && len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR) continue;
+		ok = n > 0;
+		if (ok) {
+			data += n;
+			len -= n;
+		}
+	}
+	if (close(fd) != 0) ok = 0;
+	if (ok && rename(tmp, path) == 0) return 1;
+	unlink(tmp);
+	return 0;
+}
+
+int cache_fetch(const unsigned long key[2], const char* target) {
+	if (!cache_usable()) return 0;
+	char name[33];
+	key_name(name, key);
+
+	LogBuffer body = {NULL, 0, 0};
+	double start = now_seconds();
+	int status = http_request("GET", name, NULL, 0, &body, CACHE_GET_TIMEOUT);
+	int hit = status == 200 && unpack(&body, target);
+	log_buffer_free(&body);
+	if (status == 0)
+		cache_fail("didn't answer in time");
+	else if (now_seconds() - start > CACHE_GET_SLOW)
+		cache_fail("is answering too slowly");
+	return hit;
+}
+
+// Uploading, on a thread of its own
+
+typedef struct Upload {
+	struct Upload* next;
+	unsigned long key[2];
+	char* target;  // a copy, the graph may be freed before it's sent
+} Upload;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+static Upload* queue_head = NULL;
+static Upload* queue_tail = NULL;
+static int uploading = 0;
+static int stopping = 0;
+static pthread_t uploader;
+static int uploader_running = 0;
+static long uploaded = 0;  // copied into stats by cache_finish
+
+static void upload(const Upload* u) {
+	char path[PATH_MAX], name[33];
+	snprintf(path, sizeof(path), "%s/%s", project_root, u->target);
+	struct stat st;
+	size_t len;
+	char* data = NULL;
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) ||
+		!(data = read_file(path, &len)))
+		return;
+
+	LogBuffer artifact = {NULL, 0, 0};
+	char header[64];
+	int n = snprintf(header, sizeof(header), CACHE_MAGIC " %o\n",
+					 (unsigned int)(st.st_mode & 0777));
+	log_buffer_append(&artifact, header, n);
+	log_buffer_append(&artifact, data, len);
+	free(data);
+
+	key_name(name, u->key);
+	LogBuffer response = {NULL, 0, 0};
+	int status = http_request("PUT", name, artifact.data, artifact.len,
+							  &response, CACHE_PUT_TIMEOUT);
+	log_buffer_free(&artifact);
+	log_buffer_free(&response);
+	if (status == 0) {
+		cache_fail("didn't take an upload in time");
+	} else if (status >= 200 && status < 300) {
+		pthread_mutex_lock(&lock);
+		uploaded++;
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+static void* upload_thread(void* arg) {
+	(void)arg;
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (!queue_head && !stopping) pthread_cond_wait(&wake, &lock);
+		if (stopping) break;
+
+		Upload* u = queue_head;
+		queue_head = u->next;
+		if (!queue_head) queue_tail = NULL;
+		uploading = 1;
+		pthread_mutex_unlock(&lock);
+		if (cache_usable()) upload(u);
+		free(u->target);
+		free(u);
+		pthread_mutex_lock(&lock);
+		uploading = 0;
+		pthread_cond_broadcast(&idle);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+void cache_upload(const unsigned long key[2], const char* target) {
+	if (!cache_usable()) return;
+	Upload* u = malloc(sizeof(*u));
+	char* copy = strdup(target);
+	if (!u || !copy) {
+		free(u);
+		free(copy);
+		return;	 // it's only a cache
+	}
+	*u = (Upload){NULL, {key[0], key[1]}, copy};
+
+	pthread_mutex_lock(&lock);
+	if (!uploader_running) {
+		stopping = 0;
+		uploader_running =
+			pthread_create(&uploader, NULL, upload_thread, NULL) == 0;
+	}
+	if (!uploader_running) {
+		pthread_mutex_unlock(&lock);
+		free(u->target);
+		free(u);
+		return;
+	}
+	if (queue_tail)
+		queue_tail->next = u;
+	else
+		queue_head = u;
+	queue_tail = u;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&lock);
+}
+
+// Gives the uploads still queued a little time, then leaves them. Has to
+// run before the statistics are written, the uploader counts on its own.
+void cache_finish(void) {
+	if (!uploader_running) return;
+
+	double until = now_seconds() + CACHE_DRAIN_TIMEOUT;
+	pthread_mutex_lock(&lock);
+	while ((queue_head || uploading) && now_seconds() < until) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		pthread_cond_timedwait(&idle, &lock, &ts);
+	}
+	int left = uploading;
+	while (queue_head) {
+		Upload* u = queue_head;
+		queue_head = u->next;
+		free(u->target);
+		free(u);
+		left++;
+	}
+	queue_tail = NULL;
+	stats.cache_uploads = uploaded;
+	stopping = 1;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&lock);
+
+	if (left) {
+		print("\x1b[33mWarning: gave up on %d cache upload%s\x1b[0m", left,
+			  left == 1 ? "" : "s");
+		pthread_detach(uploader);
+	} else {
+		pthread_join(uploader, NULL);
+	}
+	uploader_running = 0;
+}
+
+// Reference server
+
+static int safe_key(const char* key) {
+	if (!*key || strcmp(key, ".") == 0 || strcmp(key, "..") == 0) return 0;
+	return strspn(key, "0123456789abcdefABCDEF") == strlen(key);
+}
+
+static void respond(int fd, const char* status, const char* body,
+					size_t len) {
+	char head[256];
+	int n = snprintf(head, sizeof(head),
+					 "HTTP/1.1 %s\r\nContent-Length: %zu\r\n"
+					 "Connection: close\r\n\r\n",
+					 status, len);
+	double deadline = now_seconds() + CACHE_PUT_TIMEOUT;
+	if (send_until(fd, head, n, deadline)) send_until(fd, body, len, deadline);
+}
+
+static void serve(int fd) {
+	double deadline = now_seconds() + CACHE_PUT_TIMEOUT;
+	LogBuffer req = {NULL, 0, 0};
+	char buf[65536];
+	char* end = NULL;
+	while (!end && req.len < 16384) {
+		if (!wait_fd(fd, POLLIN, deadline)) return;
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+		if (n <= 0) return;
+		log_buffer_append(&req, buf, n);
+		log_buffer_append(&req, "", 1);
+		req.len--;
+		end = strstr(req.data, "\r\n\r\n");
+	}
+	if (!end) {
+		respond(fd, "431 Request Header Fields Too Large", "", 0);
+		return;
+	}
+	*end = '\0';
+	size_t header_len = end + 4 - req.data;
+
+	char method[8], path[256];
+	if (sscanf(req.data, "%7s %255s", method, path) != 2 || path[0] != '/' ||
+		!safe_key(path + 1)) {
+		print("\x1b[2;90m%.80s -> 400\x1b[0m", req.data);
+		respond(fd, "400 Bad Request", "", 0);
+		log_buffer_free(&req);
+		return;
+	}
+	const char* key = path + 1;
+
+	if (strcmp(method, "GET") == 0) {
+		size_t len;
+		char* data = read_file(key, &len);
+		print("\x1b[2;90mGET %s -> %d\x1b[0m", key, data ? 200 : 404);
+		if (data)
+			respond(fd, "200 OK", data, len);
+		else
+			respond(fd, "404 Not Found", "", 0);
+		free(data);
+	} else if (strcmp(method, "PUT") == 0) {
+		const char* cl = strcasestr(req.data, "\r\nContent-Length:");
+		size_t want = cl ? strtoul(cl + 17, NULL, 10) : 0;
+		int ok = cl && want <= CACHE_MAX_BODY;
+		while (ok && req.len - header_len < want) {
+			ssize_t n = 0;
+			if (!wait_fd(fd, POLLIN, deadline) ||
+				(n = recv(fd, buf, sizeof(buf), 0)) == 0) {
+				ok = 0;
+			} else if (n > 0) {
+				log_buffer_append(&req, buf, n);
+			} else if (errno != EINTR && errno != EAGAIN) {
+				ok = 0;
+			}
+		}
+
+		// readers only ever see whole artifacts
+		char tmp[300];
+		snprintf(tmp, sizeof(tmp), "%s.%d.tmp", key, (int)getpid());
+		FILE* f = ok ? fopen(tmp, "wb") : NULL;
+		ok = f && fwrite(req.data + header_len, 1, want, f) == want;
+		if (f && fclose(f) != 0) ok = 0;
+		if (ok && rename(tmp, key) != 0) ok = 0;
+		if (!ok) unlink(tmp);
+		print("\x1b[2;90mPUT %s (%zu bytes) -> %d\x1b[0m", key, want,
+			  ok ? 201 : 400);
+		if (ok)
+			respond(fd, "201 Created", "", 0);
+		else
+			respond(fd, "400 Bad Request", "", 0);
+	} else {
+		respond(fd, "405 Method Not Allowed", "", 0);
+	}
+	log_buffer_free(&req);
+}
+
+int cache_server_main(const char* address) {
+	char h[256] = "127.0.0.1";
+	const char* p = strrchr(address, ':');
+	if (p) {
+		snprintf(h, sizeof(h), "%.*s", (int)(p - address), address);
+		p++;
+	} else {
+		p = address;
+	}
+
+	struct addrinfo hints = {0};
+	struct addrinfo* res;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	int fd = -1;
+	if (getaddrinfo(h, p, &hints, &res) == 0) {
+		fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC,
+					res->ai_protocol);
+		int one = 1;
+		if (fd >= 0)
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (fd >= 0 && (bind(fd, res->ai_addr, res->ai_addrlen) != 0 ||
+						listen(fd, 64) != 0)) {
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(res);
+	}
+	if (fd < 0) {
+		print("\x1b[31mCan't listen on %s:%s: %s\x1b[0m", h, p,
+			  strerror(errno));
+		return 1;
+	}
+
+	signal(SIGCHLD, SIG_IGN);  // connection handlers reap themselves
+	print("\x1b[33mbake cache listening on %s:%s\x1b[0m", h, p);
+
+	for (;;) {
+		int conn = accept(fd, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR) continue;
+			print("\x1b[31maccept: %s\x1b[0m", strerror(errno));
+			return 1;
+		}
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(fd);
+			serve(conn);
+			close(conn);
+			_exit(0);
+		}
+		if (pid < 0) print("\x1b[31mfork: %s\x1b[0m", strerror(errno));
+		close(conn);
+	}
+}
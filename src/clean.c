@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bake.h"
+
+// --clean [targets] removes the outputs of the targets' subgraphs and
+// --prune the outputs no recipe claims anymore (left behind by renamed or
+// deleted sources). Both only delete files in the output manifest, i.e. files
+// a recipe of ours produced, so sources and hand made files are never touched,
+// and only while they are as Bake left them.
+
+#define CLEAN_THREADS_MAX 16
+
+typedef struct {
+	int* nodes;
+	int* errors;  // errno per node, 0 if it's gone
+	size_t count;
+	size_t capacity;
+} CleanList;
+
+static CleanList list = {NULL, NULL, 0, 0};
+
+static void clean_add(int node) {
+	if (list.count == list.capacity) {
+		size_t new_cap = list.capacity ? list.capacity * 2 : 256;
+		int* nodes = realloc(list.nodes, new_cap * sizeof(int));
+		if (nodes) list.nodes = nodes;
+		int* errors = realloc(list.errors, new_cap * sizeof(int));
+		if (errors) list.errors = errors;
+		if (!nodes || !errors) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		list.capacity = new_cap;
+	}
+	list.nodes[list.count++] = node;
+}
+
+// Files changed since Bake wrote them are someone else's now and stay
+static int still_ours(int node, time_t output_mtime) {
+	return output_mtime && node_stat(node) == NODE_FILE &&
+		   node_arr.data[node].mtime == output_mtime;
+}
+
+// Walks the subgraph below recipe, the same way the build does
+static void clean_walk(Recipe* recipe) {
+	if (recipe->state != RECIPE_UNVISITED) return;
+	recipe->state = RECIPE_DONE;
+
+	StateEntry* state = state_get(recipe->target);
+	if (state && still_ours(recipe->target, state->output_mtime))
+		clean_add(recipe->target);
+
+	int discovered = state ? state->discovered_count : 0;
+	for (int i = 0; i < recipe->deplen + discovered; i++) {
+		int dep = i < recipe->deplen ? recipe->dependencies[i]
+									 : state->discovered[i - recipe->deplen];
+		int idx = node_arr.data[dep].recipe;
+		if (idx >= 0) clean_walk(&recipe_arr.data[idx]);
+	}
+}
+
+void clean_collect(const char* target) {
+	Recipe* recipe = recipe_find(target);
+	if (recipe) clean_walk(recipe);
+}
+
+// Outputs whose recipe is gone
+void prune_collect(void) {
+	for (size_t i = 0; i < state_arr.count; i++) {
+		StateEntry* e = &state_arr.data[i];
+		if (node_arr.data[e->target].recipe >= 0) continue;
+
+		// whatever we knew about the recipe goes with it
+		time_t mtime = e->output_mtime;
+		state_forget(e);
+		if (still_ours(e->target, mtime)) clean_add(e->target);
+	}
+}
+
+typedef struct {
+	int root;  // project root directory
+	size_t first;
+	size_t step;
+} CleanWorker;
+
+// Threads take every step'th file, unlinkat only needs the path
+static void* clean_thread(void* arg) {
+	CleanWorker* w = arg;
+	for (size_t i = w->first; i < list.count; i += w->step) {
+		int err = 0;
+		if (unlinkat(w->root, node_path(list.nodes[i]), 0) != 0 &&
+			errno != ENOENT)
+			err = errno;
+		list.errors[i] = err;
+	}
+	return NULL;
+}
+
+void clean_remove(void) {
+	if (list.count == 0) {
+		print("\x1b[33mNothing to clean.\x1b[0m");
+		return;
+	}
+
+	int root = open(project_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (root < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+
+	// a thread per 64 files, deleting is mostly waiting on the filesystem
+	size_t threads = args.jobs > 1 ? (size_t)args.jobs : 4;
+	if (threads > CLEAN_THREADS_MAX) threads = CLEAN_THREADS_MAX;
+	if (threads > (list.count + 63) / 64) threads = (list.count + 63) / 64;
+
+	pthread_t ids[CLEAN_THREADS_MAX];
+	CleanWorker workers[CLEAN_THREADS_MAX];
+	for (size_t i = 0; i < threads; i++)
+		workers[i] = (CleanWorker){root, i, threads};
+	size_t started = 0;
+	while (started < threads) {
+		CleanWorker* w = &workers[started];
+		if (pthread_create(&ids[started], NULL, clean_thread, w) != 0) break;
+		started++;
+	}
+	// whatever didn't get a thread runs here
+	for (size_t i = started; i < threads; i++) clean_thread(&workers[i]);
+	for (size_t i = 0; i < started; i++) pthread_join(ids[i], NULL);
+	close(root);
+
+	size_t removed = 0;
+	for (size_t i = 0; i < list.count; i++) {
+		int node = list.nodes[i];
+		if (list.errors[i]) {
+			print("\x1b[31mCould not remove %s: %s\x1b[0m", node_path(node),
+				  strerror(list.errors[i]));
+			continue;
+		}
+		state_set_output(state_get(node), 0);
+		node_stat_invalidate(node);
+		removed++;
+	}
+	print("\x1b[33mRemoved %zu output%s.\x1b[0m", removed,
+		  removed == 1 ? "" : "s");
+
+	free(list.nodes);
+	free(list.errors);
+	list = (CleanList){NULL, NULL, 0, 0};
+}
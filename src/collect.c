@@ -31,7 +31,7 @@ static void collect_impl(lua_State* L, const char* dir, const char* pattern,
 		snprintf(path, path_len, "%s/%s", dir, e->d_name);
 
 		struct stat st;
-		if (stat(path, &st) == 0) {
+		if (bake_stat(path, &st) == 0) {
 			if (S_ISDIR(st.st_mode)) {
 				// Recurse into subdirectory
 				collect_impl(L, path, pattern, index);
@@ -50,9 +50,11 @@ int l_collect(lua_State* L) {
 	const char* dir = luaL_checkstring(L, 1);
 	const char* pattern = luaL_optstring(L, 2, NULL);
 
+	double start = now_seconds();
 	lua_newtable(L);  // result table
 	int index = 1;
 	collect_impl(L, dir, pattern, &index);
+	stats.collect_time += now_seconds() - start;
 
 	return 1;
 }
@@ -0,0 +1,159 @@
+#include <errno.h>
+#include <limits.h>
+#include <lua5.3/lauxlib.h>
+#include <lua5.3/lua.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bake.h"
+
+// bake.include("lib/foo") evaluates lib/foo/bake.lua into this graph instead
+// of running a second bake on it. The sub-project's paths are rebased onto
+// the project root while it's evaluated, so its "build/foo.o" becomes the
+// node "lib/foo/build/foo.o" and everything shares one scheduler, one stat
+// cache and one state file. Its recipes still run from lib/foo.
+
+const char* include_dir = NULL;
+
+static int included = LUA_NOREF;  // dir -> goals table, false while loading
+static int include_goals = LUA_NOREF;  // what the sub-project bake()'d
+
+// Path as seen from the project root. ALWAYS and absolute paths are left
+// alone, everything else is taken relative to the sub-project.
+const char* include_rebase(const char* path, char* buf, size_t size) {
+	if (!include_dir || path[0] == '/' || strcmp(path, "ALWAYS") == 0)
+		return path;
+	snprintf(buf, size, "%s/%s", include_dir, path);
+	normalize_path(buf);
+	return buf;
+}
+
+// The other way around: a project relative path as seen from dir
+const char* path_from(const char* dir, const char* path, char* buf,
+					  size_t size) {
+	if (!dir || path[0] == '/') return path;
+
+	// skip the leading components both have in common
+	const char* d = dir;
+	const char* p = path;
+	while (*d) {
+		size_t len = strcspn(d, "/");
+		if (strncmp(d, p, len) != 0 || (p[len] != '/' && p[len] != '\0'))
+			break;
+		d += len + (d[len] == '/');
+		p += len + (p[len] == '/');
+	}
+
+	// and climb out of whatever is left of dir
+	size_t n = 0;
+	buf[0] = '\0';
+	while (*d && n + 3 < size) {
+		n += snprintf(buf + n, size - n, n ? "/.." : "..");
+		d += strcspn(d, "/");
+		d += *d == '/';
+	}
+	if (*p)
+		snprintf(buf + n, size - n, "%s%s", n ? "/" : "", p);
+	else if (n == 0)
+		snprintf(buf, size, ".");
+	return buf;
+}
+
+// bake(goals) inside an included bakefile only records them, the top level
+// decides what gets built.
+static int record_goals(lua_State* L) {
+	char buf[PATH_MAX];
+	lua_newtable(L);
+	lua_Integer n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, 1) != 0) {
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			lua_pushstring(L, include_rebase(lua_tostring(L, -1), buf,
+											 sizeof(buf)));
+			lua_rawseti(L, -4, ++n);
+		}
+		lua_pop(L, 1);
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, include_goals);
+	include_goals = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 0;
+}
+
+int l_bake_call(lua_State* L) {
+	lua_remove(L, 1);  // the bake table itself
+	if (include_dir) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		return record_goals(L);
+	}
+	return l_bake(L);
+}
+
+static void leave(const char* parent) {
+	if (chdir(project_root) != 0 || (parent && chdir(parent) != 0)) {
+		perror("chdir");
+		exit(EXIT_FAILURE);
+	}
+	include_dir = parent;
+}
+
+// bake.include(dir [, file]) -> goals the sub-project passed to bake(),
+// rebased. Including the same directory again just returns them again.
+int l_include(lua_State* L) {
+	const char* sub = luaL_checkstring(L, 1);
+	const char* file = luaL_optstring(L, 2, "bake.lua");
+	if (sub[0] == '/')
+		return luaL_error(L, "Can't include '%s', it's outside the project",
+						  sub);
+
+	char dir[PATH_MAX];
+	const char* rebased = include_rebase(sub, dir, sizeof(dir));
+	if (rebased != dir) snprintf(dir, sizeof(dir), "%s", rebased);
+	normalize_path(dir);
+	if (strcmp(dir, ".") == 0 || strcmp(dir, "..") == 0 ||
+		strncmp(dir, "../", 3) == 0)
+		return luaL_error(L, "Can't include '%s', it's not a sub-project",
+						  sub);
+
+	if (included == LUA_NOREF) {
+		lua_newtable(L);
+		included = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, included);
+	lua_getfield(L, -1, dir);
+	if (lua_istable(L, -1)) return 1;
+	if (lua_isboolean(L, -1))
+		return luaL_error(L, "'%s' includes itself", dir);
+	lua_pop(L, 1);
+	lua_pushboolean(L, 0);
+	lua_setfield(L, -2, dir);
+
+	const char* parent = include_dir;
+	int parent_goals = include_goals;
+	if (chdir(sub) != 0)
+		return luaL_error(L, "Can't enter '%s': %s", dir, strerror(errno));
+	include_dir = arena_strdup(&graph_arena, dir);
+	include_goals = LUA_NOREF;
+
+	print("\x1b[33mIncluding \x1b[35m\"%s\"\x1b[0m", include_dir);
+	int status = luaL_loadfile(L, file) || lua_pcall(L, 0, 0, 0);
+	leave(parent);
+
+	int goals = include_goals;
+	include_goals = parent_goals;
+	if (status) {
+		luaL_unref(L, LUA_REGISTRYINDEX, goals);
+		return luaL_error(L, "In %s/%s: %s", dir, file, lua_tostring(L, -1));
+	}
+
+	if (goals == LUA_NOREF) {
+		lua_newtable(L);
+	} else {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, goals);
+		luaL_unref(L, LUA_REGISTRYINDEX, goals);
+	}
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -3, dir);  // included[dir] = goals
+	return 1;
+}
@@ -1,4 +1,14 @@
+#include <errno.h>
+#include <limits.h>
 #include <lua5.3/lauxlib.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "bake.h"
 
@@ -9,35 +19,226 @@ int l_yell(lua_State* L) {
 	return 0;
 }
 
+static int use_color = 1;
+// active job buffer, NULL writes through. Per thread, so the progress thread
+// never ends up inside a job's block.
+static __thread LogBuffer* capture = NULL;
+
+// stderr is shared with the progress thread's status line, and the
+// indentation with every thread that prints
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
 static int indentation = 0;
+static int status_shown = 0;
+static char status_text[512];
+
+static const char spaces[] = "                                                ";
 
 int indent_log(int delta) {
+	pthread_mutex_lock(&out_lock);
 	indentation += delta;
 	if (indentation < 0) indentation = 0;
-	return indentation;
+	int depth = indentation;
+	pthread_mutex_unlock(&out_lock);
+	return depth;
+}
+
+static int current_indentation(void) {
+	pthread_mutex_lock(&out_lock);
+	int depth = indentation;
+	pthread_mutex_unlock(&out_lock);
+	return depth;
+}
+
+void log_init(void) {
+	use_color = args.log_format == LOG_TEXT && isatty(STDERR_FILENO);
+}
+
+// writev that copes with short writes and EINTR, call with out_lock held
+static void write_locked(struct iovec* iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t n = writev(STDERR_FILENO, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return;	 // nowhere left to report it
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+static const char clear_line[] = "\r\x1b[K";
+
+// Log output goes above the status line: wipe it, the progress thread draws
+// it again on its next tick.
+static void write_all(struct iovec* iov, int iovcnt) {
+	pthread_mutex_lock(&out_lock);
+	if (status_shown) {
+		struct iovec clear = {(void*)clear_line, sizeof(clear_line) - 1};
+		write_locked(&clear, 1);
+		status_shown = 0;
+	}
+	write_locked(iov, iovcnt);
+	pthread_mutex_unlock(&out_lock);
+}
+
+void log_status(const char* line) {
+	const char* text = line ? line : "";
+	struct iovec iov[2] = {{(void*)clear_line, sizeof(clear_line) - 1},
+						   {(void*)text, strlen(text)}};
+	pthread_mutex_lock(&out_lock);
+	int same = status_shown && line && strcmp(line, status_text) == 0;
+	if (!same && (line || status_shown)) write_locked(iov, 2);
+	status_shown = line != NULL;
+	snprintf(status_text, sizeof(status_text), "%s", text);
+	pthread_mutex_unlock(&out_lock);
+}
+
+void log_buffer_append(LogBuffer* buf, const char* data, size_t len) {
+	if (buf->len + len > buf->cap) {
+		size_t new_cap = buf->cap ? buf->cap : 1024;
+		while (new_cap < buf->len + len) new_cap *= 2;
+		char* tmp = realloc(buf->data, new_cap);
+		if (!tmp) return;  // drop the message rather than the build
+		buf->data = tmp;
+		buf->cap = new_cap;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+// Sends the iovecs to the job buffer if one is active, else to stderr
+static void emit(struct iovec* iov, int iovcnt) {
+	if (capture) {
+		for (int i = 0; i < iovcnt; i++)
+			log_buffer_append(capture, iov[i].iov_base, iov[i].iov_len);
+	} else {
+		write_all(iov, iovcnt);
+	}
+}
+
+// Drops ANSI escape sequences in place, returns the new length
+static size_t strip_ansi(char* s, size_t len) {
+	size_t out = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] == '\x1b' && i + 1 < len && s[i + 1] == '[') {
+			i += 2;
+			while (i < len && !(s[i] >= '@' && s[i] <= '~')) i++;
+			continue;
+		}
+		s[out++] = s[i];
+	}
+	return out;
+}
+
+static void emit_text(const char* msg, size_t len) {
+	struct iovec iov[64];
+	int n = 0;
+	size_t ind = current_indentation() * 2;
+	if (ind > sizeof(spaces) - 1) ind = sizeof(spaces) - 1;
+
+	// one iovec pair per line: indentation, then the line itself
+	const char* line = msg;
+	const char* end = msg + len;
+	while (line <= end) {
+		const char* nl = memchr(line, '\n', end - line);
+		const char* line_end = nl ? nl + 1 : end;
+
+		if (n + 3 > (int)(sizeof(iov) / sizeof(*iov))) {
+			emit(iov, n);  // only very long messages take several calls
+			n = 0;
+		}
+		iov[n++] = (struct iovec){(void*)spaces, ind};
+		iov[n++] = (struct iovec){(void*)line, line_end - line};
+
+		if (!nl) break;
+		line = nl + 1;
+		if (line == end) break;	 // message ended with a newline
+	}
+	iov[n++] = (struct iovec){"\n", 1};
+	emit(iov, n);
+}
+
+static void emit_json(const char* msg, size_t len) {
+	LogBuffer line = {NULL, 0, 0};
+	char head[64];
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	int n = snprintf(head, sizeof(head), "{\"time\":%ld.%03ld,\"depth\":%d,",
+					 (long)ts.tv_sec, ts.tv_nsec / 1000000,
+					 current_indentation());
+	log_buffer_append(&line, head, n);
+	log_buffer_append(&line, "\"message\":\"", 11);
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = msg[i];
+		if (c == '"' || c == '\\') {
+			char esc[2] = {'\\', c};
+			log_buffer_append(&line, esc, 2);
+		} else if (c < 0x20) {
+			char esc[8];
+			int e = c == '\n' ? snprintf(esc, sizeof(esc), "\\n")
+							  : snprintf(esc, sizeof(esc), "\\u%04x", c);
+			log_buffer_append(&line, esc, e);
+		} else {
+			log_buffer_append(&line, (const char*)&msg[i], 1);
+		}
+	}
+	log_buffer_append(&line, "\"}\n", 3);
+
+	struct iovec iov = {line.data, line.len};
+	if (line.data) emit(&iov, 1);
+	free(line.data);
 }
 
 void print(const char* fmt, ...) {
-	int ind = indentation * 2;
-	char buffer[2048];
+	char stack[2048];
+	char* msg = stack;
 
 	va_list ap;
 	va_start(ap, fmt);
-	vsnprintf(buffer, sizeof(buffer), fmt, ap);
+	int len = vsnprintf(stack, sizeof(stack), fmt, ap);
 	va_end(ap);
+	if (len < 0) return;
 
-	const char* p = buffer;
-	int at_start = 1;
-	while (*p) {
-		if (at_start) {
-			for (int i = 0; i < ind; i++) fputc(' ', stderr);
-			at_start = 0;
-		}
-		fputc(*p, stderr);
-		if (*p == '\n') {
-			at_start = 1;
-		}
-		p++;
+	// long compiler errors don't fit on the stack, format again on the heap
+	if ((size_t)len >= sizeof(stack)) {
+		msg = malloc(len + 1);
+		if (!msg) return;
+		va_start(ap, fmt);
+		vsnprintf(msg, len + 1, fmt, ap);
+		va_end(ap);
 	}
-	fputc('\n', stderr);
+
+	size_t size = len;
+	if (!use_color) size = strip_ansi(msg, size);
+
+	if (args.log_format == LOG_JSON) {
+		emit_json(msg, size);
+	} else {
+		emit_text(msg, size);
+	}
+
+	if (msg != stack) free(msg);
+}
+
+void log_capture(LogBuffer* buf) { capture = buf; }
+
+void log_flush(LogBuffer* buf) {
+	if (buf->len) {
+		struct iovec iov = {buf->data, buf->len};
+		write_all(&iov, 1);
+	}
+	buf->len = 0;
+}
+
+void log_buffer_free(LogBuffer* buf) {
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = buf->cap = 0;
 }
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bake.h"
+
+// Every path the graph mentions (targets and dependencies) is interned here
+// exactly once; recipes refer to them by node ID.
+
+Arena graph_arena = {NULL, 0};
+NodeArray node_arr = {NULL, 0, 0};
+
+// Open addressing table: slot -> node ID + 1 (0 means empty).
+static int* node_index = NULL;
+static size_t node_index_cap = 0;
+
+static size_t node_slot(const char* path) {
+	size_t mask = node_index_cap - 1;
+	size_t slot = hash_string(path) & mask;
+	while (node_index[slot] &&
+		   strcmp(node_arr.data[node_index[slot] - 1].path, path) != 0)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+static void node_index_grow(void) {
+	size_t new_cap = node_index_cap ? node_index_cap * 2 : 256;
+	int* tmp = calloc(new_cap, sizeof(*tmp));
+	if (!tmp) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	free(node_index);
+	node_index = tmp;
+	node_index_cap = new_cap;
+	for (size_t i = 0; i < node_arr.count; i++) {
+		node_index[node_slot(node_arr.data[i].path)] = (int)i + 1;
+	}
+}
+
+void nodes_init(void) {
+	node_intern("ALWAYS");	// first node, so its ID is NODE_ALWAYS
+}
+
+int node_lookup(const char* path) {
+	if (!path || !node_index) return -1;
+	return node_index[node_slot(path)] - 1;
+}
+
+int node_intern(const char* path) {
+	// keep the load factor under 1/2
+	if ((node_arr.count + 1) * 2 > node_index_cap) node_index_grow();
+
+	size_t slot = node_slot(path);
+	if (node_index[slot]) return node_index[slot] - 1;
+
+	if (node_arr.count >= node_arr.capacity) {
+		size_t new_cap = node_arr.capacity ? node_arr.capacity * 2 : 256;
+		Node* tmp = realloc(node_arr.data, new_cap * sizeof(*tmp));
+		if (!tmp) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		node_arr.data = tmp;
+		node_arr.capacity = new_cap;
+	}
+
+	int id = (int)node_arr.count++;
+	node_arr.data[id].path = arena_strdup(&graph_arena, path);
+	node_arr.data[id].recipe = -1;
+	node_arr.data[id].state = -1;
+	node_arr.data[id].stat_state = NODE_STAT_UNKNOWN;
+	node_arr.data[id].mtime = 0;
+	node_index[slot] = id + 1;
+	return id;
+}
+
+// Cached stat, sources don't change under us during a build and targets are
+// invalidated by the build once their recipe has run.
+int node_stat(int id) {
+	Node* n = &node_arr.data[id];
+	if (n->stat_state != NODE_STAT_UNKNOWN) {
+		stats.stat_cache_hits++;
+		return n->stat_state;
+	}
+
+	struct stat st;
+	if (bake_stat(n->path, &st) != 0) {
+		n->stat_state = NODE_MISSING;
+	} else {
+		n->stat_state = S_ISDIR(st.st_mode) ? NODE_DIR : NODE_FILE;
+		n->mtime = st.st_mtime;
+	}
+	return n->stat_state;
+}
+
+void node_stat_invalidate(int id) {
+	node_arr.data[id].stat_state = NODE_STAT_UNKNOWN;
+}
+
+size_t nodes_memory(void) {
+	return graph_arena.bytes + node_arr.capacity * sizeof(Node) +
+		   node_index_cap * sizeof(*node_index);
+}
+
+void nodes_free(void) {
+	free(node_index);
+	node_index = NULL;
+	node_index_cap = 0;
+	free(node_arr.data);
+	node_arr.data = NULL;
+	node_arr.count = node_arr.capacity = 0;
+	arena_free(&graph_arena);
+}
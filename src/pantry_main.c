@@ -68,7 +68,7 @@ int l_is_shelf(lua_State* L) {
 		return 1;
 	}
 	struct stat st;
-	if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+	if (bake_stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
 		lua_pushboolean(L, 1);
 	} else {
 		lua_pushboolean(L, 0);
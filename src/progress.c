@@ -0,0 +1,239 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bake.h"
+
+// Before building, the goals are walked once to count the recipes that will
+// run. What each is expected to take comes from .bake/state, so the ETA gets
+// better as the project is built. A background thread redraws a status line
+// on terminals ten times a second, or logs a summary every ten seconds when
+// stderr isn't one. The graph is only ever touched on the main thread, the
+// thread reads the counters below under the lock.
+
+#define TTY_INTERVAL 0.1
+#define LOG_INTERVAL 10.0
+
+typedef struct {
+	size_t recipe;
+	const char* name;  // node paths live in the arena, node_arr may move
+	double start;
+	double expected;
+} Running;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t thread;
+static int thread_running = 0;
+static int stopping = 0;
+static int tty = 0;
+static size_t width = 0;
+
+static char* planned = NULL;  // per recipe, whether the plan expects it to run
+static size_t planned_count = 0;
+static int total = 0;
+static int finished = 0;
+static double pending = 0;	// expected seconds of planned recipes not started
+static double average = 1;	// for recipes that never succeeded before
+static Running* running = NULL;
+static int running_count = 0;
+static int running_cap = 0;
+
+static double expected(size_t idx) {
+	StateEntry* e = state_get(recipe_arr.data[idx].target);
+	return e && e->duration > 0 ? e->duration : average;
+}
+
+// The build walk without running anything: a recipe runs if it's out of
+// date now or if anything it depends on runs.
+static int plan(size_t idx) {
+	Recipe* r = &recipe_arr.data[idx];
+	if (r->state == RECIPE_DONE) return planned[idx];
+	if (r->state == RECIPE_VISITING) return 0;
+	r->state = RECIPE_VISITING;
+
+	int runs = args.force;
+	StateEntry* state = state_get(r->target);
+	int discovered = state ? state->discovered_count : 0;
+	for (int i = 0; i < r->deplen + discovered; i++) {
+		int dep = i < r->deplen ? r->dependencies[i]
+								: state->discovered[i - r->deplen];
+		int dep_idx = node_arr.data[dep].recipe;
+		if (dep_idx >= 0 && plan(dep_idx)) runs = 1;
+	}
+	if (!runs) runs = is_out_of_date(r, NULL) != STALE_FRESH;
+
+	r->state = RECIPE_DONE;
+	planned[idx] = runs;
+	if (runs) {
+		total++;
+		pending += expected(idx);
+	}
+	return runs;
+}
+
+void progress_plan(const char* target) {
+	if (!args.progress || args.dry_run) return;
+
+	if (planned_count < recipe_arr.count) {
+		// the first goal: recipes are all known by now
+		char* tmp = realloc(planned, recipe_arr.count);
+		if (!tmp) return;
+		memset(tmp + planned_count, 0, recipe_arr.count - planned_count);
+		planned = tmp;
+		planned_count = recipe_arr.count;
+
+		double sum = 0;
+		int known = 0;
+		for (size_t i = 0; i < state_arr.count; i++) {
+			if (state_arr.data[i].duration <= 0) continue;
+			sum += state_arr.data[i].duration;
+			known++;
+		}
+		if (known) average = sum / known;
+	}
+
+	Recipe* recipe = recipe_find(target);
+	if (recipe) plan(recipe - recipe_arr.data);
+}
+
+static void format_duration(char* buf, size_t size, double seconds) {
+	long s = (long)(seconds + 0.5);
+	if (s >= 3600)
+		snprintf(buf, size, "%ldh%02ldm", s / 3600, s / 60 % 60);
+	else if (s >= 60)
+		snprintf(buf, size, "%ldm%02lds", s / 60, s % 60);
+	else
+		snprintf(buf, size, "%lds", s);
+}
+
+// "[12/40] 3 running, slowest build/foo.o (14s), ETA 1m05s", call with the
+// lock held
+static void format_status(char* buf, size_t size) {
+	double now = now_seconds();
+	double remaining = pending, longest = 0;
+	const Running* slowest = NULL;
+	for (int i = 0; i < running_count; i++) {
+		const Running* r = &running[i];
+		double left = r->expected - (now - r->start);
+		if (left > 0) remaining += left;
+		if (left > longest) longest = left;
+		if (!slowest || r->start < slowest->start) slowest = r;
+	}
+
+	// assumes every slot stays busy, but never less than the longest job
+	int slots = (args.jobs > 0 ? args.jobs : 1) + args.worker_count;
+	double eta = remaining / slots;
+	if (eta < longest) eta = longest;
+
+	int all = total > finished + running_count ? total
+											   : finished + running_count;
+	char eta_str[32], slow_str[32];
+	format_duration(eta_str, sizeof(eta_str), eta);
+	if (slowest) {
+		format_duration(slow_str, sizeof(slow_str), now - slowest->start);
+		snprintf(buf, size, "[%d/%d] %d running, slowest %s (%s), ETA %s",
+				 finished, all, running_count, slowest->name, slow_str,
+				 eta_str);
+	} else {
+		snprintf(buf, size, "[%d/%d] ETA %s", finished, all, eta_str);
+	}
+}
+
+static void* progress_thread(void* arg) {
+	(void)arg;
+	double interval = tty ? TTY_INTERVAL : LOG_INTERVAL;
+	char line[512];
+
+	pthread_mutex_lock(&lock);
+	while (!stopping) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		double until = ts.tv_sec + ts.tv_nsec / 1e9 + interval;
+		ts.tv_sec = (time_t)until;
+		ts.tv_nsec = (long)((until - ts.tv_sec) * 1e9);
+		pthread_cond_timedwait(&wake, &lock, &ts);
+		if (stopping) break;
+
+		format_status(line, sizeof(line));
+		pthread_mutex_unlock(&lock);
+		if (tty) {
+			// a wrapped line can't be redrawn in place
+			if (width > 1 && strlen(line) >= width) line[width - 1] = '\0';
+			log_status(line);
+		} else {
+			print("\x1b[33m%s\x1b[0m", line);
+		}
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+void progress_start(void) {
+	if (!args.progress || args.dry_run || thread_running || total == 0)
+		return;
+
+	tty = args.log_format == LOG_TEXT && isatty(STDERR_FILENO);
+	struct winsize ws;
+	if (tty && ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) == 0) width = ws.ws_col;
+
+	static int registered = 0;
+	if (!registered) {
+		atexit(progress_stop);	// failed builds exit from wherever they are
+		registered = 1;
+	}
+	stopping = 0;
+	if (pthread_create(&thread, NULL, progress_thread, NULL) == 0)
+		thread_running = 1;
+}
+
+void progress_begin(size_t recipe) {
+	pthread_mutex_lock(&lock);
+	if (running_count == running_cap) {
+		int new_cap = running_cap ? running_cap * 2 : 16;
+		Running* tmp = realloc(running, new_cap * sizeof(*tmp));
+		if (!tmp) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		running = tmp;
+		running_cap = new_cap;
+	}
+
+	double exp = expected(recipe);
+	if (recipe < planned_count && planned[recipe]) {
+		pending -= exp;
+		planned[recipe] = 0;  // only counted once
+		if (pending < 0) pending = 0;
+	}
+	running[running_count++] = (Running){
+		recipe, node_path(recipe_arr.data[recipe].target), now_seconds(), exp};
+	pthread_mutex_unlock(&lock);
+}
+
+void progress_end(size_t recipe) {
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < running_count; i++) {
+		if (running[i].recipe != recipe) continue;
+		running[i] = running[--running_count];
+		break;
+	}
+	finished++;
+	pthread_mutex_unlock(&lock);
+}
+
+void progress_stop(void) {
+	if (!thread_running) return;
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	thread_running = 0;
+	if (tty) log_status(NULL);
+}
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <lua5.3/lauxlib.h>
 #include <lua5.3/lua.h>
 #include <stdio.h>
@@ -9,6 +10,22 @@
 
 RecipeArray recipe_arr;
 
+// Reverse edges, stored CSR style: the dependents of node n are
+// dependents_edges[dependents_offsets[n] .. dependents_offsets[n + 1]].
+static size_t* dependents_offsets = NULL;
+static size_t* dependents_edges = NULL;
+static size_t dependents_nodes = 0;
+static size_t dependents_edge_count = 0;
+
+static void dependents_free(void) {
+	free(dependents_offsets);
+	free(dependents_edges);
+	dependents_offsets = NULL;
+	dependents_edges = NULL;
+	dependents_nodes = 0;
+	dependents_edge_count = 0;
+}
+
 void recipe_add(Recipe recipe) {
 	if (recipe_arr.count >= recipe_arr.capacity) {
 		if (recipe_arr.capacity == 0) recipe_arr.capacity = 8;
@@ -22,66 +39,111 @@ void recipe_add(Recipe recipe) {
 		recipe_arr.data = tmp;
 	}
 	recipe_arr.data[recipe_arr.count++] = recipe;
+
+	// the reverse index is stale as soon as the graph changes
+	if (dependents_offsets) dependents_free();
+
+	// keep the first definition, recipe_find always returned that one
+	if (recipe.target >= 0 && node_arr.data[recipe.target].recipe < 0)
+		node_arr.data[recipe.target].recipe = (int)recipe_arr.count - 1;
+}
+
+Recipe* recipe_find(const char* target) {
+	int id = node_lookup(target);
+	if (id < 0 || node_arr.data[id].recipe < 0) return NULL;
+	return &recipe_arr.data[node_arr.data[id].recipe];
 }
 
-Recipe* recipe_find(char* target) {
-	if (!target || !recipe_arr.data || recipe_arr.count == 0) return NULL;
+void recipes_index_dependents(void) {
+	if (dependents_offsets) return;
+
+	dependents_nodes = node_arr.count;
+	dependents_offsets = calloc(dependents_nodes + 1, sizeof(size_t));
+	if (!dependents_offsets) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	// first pass: count incoming edges per node
+	for (size_t i = 0; i < recipe_arr.count; i++) {
+		Recipe* r = &recipe_arr.data[i];
+		if (r->target < 0) continue;  // unexpanded wildcard
+		for (int j = 0; j < r->deplen; j++) {
+			dependents_offsets[r->dependencies[j] + 1]++;
+		}
+		StateEntry* state = state_get(r->target);
+		for (int j = 0; state && j < state->discovered_count; j++) {
+			dependents_offsets[state->discovered[j] + 1]++;
+		}
+	}
+	for (size_t n = 0; n < dependents_nodes; n++) {
+		dependents_offsets[n + 1] += dependents_offsets[n];
+	}
+	dependents_edge_count = dependents_offsets[dependents_nodes];
+
+	dependents_edges =
+		malloc((dependents_edge_count ? dependents_edge_count : 1) *
+			   sizeof(*dependents_edges));
+	size_t* fill = malloc((dependents_nodes ? dependents_nodes : 1) *
+						  sizeof(*fill));
+	if (!dependents_edges || !fill) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(fill, dependents_offsets, dependents_nodes * sizeof(*fill));
 
-	for (int i = 0; i < recipe_arr.count; i++) {
-		if (!recipe_arr.data[i].target) continue;
-		if (strcmp(target, recipe_arr.data[i].target) == 0) {
-			return &recipe_arr.data[i];
+	// second pass: fill the edge lists
+	for (size_t i = 0; i < recipe_arr.count; i++) {
+		Recipe* r = &recipe_arr.data[i];
+		if (r->target < 0) continue;
+		for (int j = 0; j < r->deplen; j++) {
+			dependents_edges[fill[r->dependencies[j]]++] = i;
+		}
+		StateEntry* state = state_get(r->target);
+		for (int j = 0; state && j < state->discovered_count; j++) {
+			dependents_edges[fill[state->discovered[j]]++] = i;
 		}
 	}
-	return NULL;
+	free(fill);
+}
+
+const size_t* recipe_dependents(int node, size_t* count) {
+	*count = 0;
+	if (node < 0 || (size_t)node >= dependents_nodes) return NULL;
+
+	*count = dependents_offsets[node + 1] - dependents_offsets[node];
+	return &dependents_edges[dependents_offsets[node]];
+}
+
+size_t recipes_memory(void) {
+	size_t bytes = recipe_arr.capacity * sizeof(Recipe);
+	if (dependents_offsets)
+		bytes += (dependents_nodes * 2 + 1) * sizeof(size_t) +
+				 dependents_edge_count * sizeof(size_t);
+	return bytes + nodes_memory();
 }
 
 void recipes_free(lua_State* L) {
-	if (!recipe_arr.data) return;
+	dependents_free();
 
 	for (size_t i = 0; i < recipe_arr.count; i++) {
 		Recipe* r = &recipe_arr.data[i];
 
-		// Free Lua function reference if any
-		if (r->function != LUA_NOREF) {
+		// Expanded wildcards share their pattern's function reference
+		int expanded = r->target >= 0 && r->pattern_target;
+		if (r->function != LUA_NOREF && !expanded) {
 			luaL_unref(L, LUA_REGISTRYINDEX, r->function);
 			r->function = LUA_NOREF;
 		}
-
-		// Free target string
-		if (r->target) {
-			free(r->target);
-			r->target = NULL;
-		}
-
-		// Free pattern target
-		if (r->pattern_target) {
-			free(r->pattern_target);
-			r->pattern_target = NULL;
-		}
-
-		// Free dependencies
-		if (r->dependencies) {
-			for (int j = 0; j < r->deplen; j++) {
-				if (r->dependencies[j]) {
-					free(r->dependencies[j]);
-					r->dependencies[j] = NULL;
-				}
-			}
-			free(r->dependencies);
-			r->dependencies = NULL;
-		}
-
-		// Don't free pattern dependencies
-
-		r->deplen = 0;
 	}
 
-	// Free the array itself
+	// Strings and dependency arrays live in the graph arena
 	free(recipe_arr.data);
 	recipe_arr.data = NULL;
 	recipe_arr.count = 0;
 	recipe_arr.capacity = 0;
+	state_free();
+	nodes_free();
 }
 
 int l_recipe(lua_State* L) {
@@ -89,68 +151,86 @@ int l_recipe(lua_State* L) {
 		return luaL_error(L, "Expected string as first argument");
 	if (!lua_istable(L, 2))
 		return luaL_error(L, "Expected table as second argument");
-	if (!lua_isfunction(L, 3))
-		return luaL_error(L, "Expected function as third argument");
+	if (!lua_isfunction(L, 3) && !lua_isstring(L, 3))
+		return luaL_error(
+			L, "Expected function or command string as third argument");
+
+	// {unity = n} compiles a pattern's sources n at a time, see unity.c
+	lua_Integer unity = 0;
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		lua_getfield(L, 4, "unity");
+		unity = luaL_optinteger(L, -1, 0);
+		if (unity < 0) return luaL_error(L, "unity can't be negative");
+	}
+	lua_settop(L, 3);  // luaL_ref below takes the function from the top
 
-	const char* luaTarget = lua_tostring(L, 1);
+	// inside bake.include the paths are the sub-project's
+	char targetBuf[PATH_MAX], depBuf[PATH_MAX];
+	const char* luaTarget =
+		include_rebase(lua_tostring(L, 1), targetBuf, sizeof(targetBuf));
 	size_t tableLen = lua_rawlen(L, 2);
 
-	// Allocate dependency array
-	char** depTable = malloc(tableLen * sizeof(char*));
-	if (!depTable) return luaL_error(L, "Memory allocation failed");
-
 	int wildcard = strchr(luaTarget, '%') != NULL;
 
+	// Collect dependency strings first, wildcards keep them as patterns
+	const char** depStrings = malloc((tableLen ? tableLen : 1) * sizeof(char*));
+	if (!depStrings) return luaL_error(L, "Memory allocation failed");
+	size_t depCount = 0;
 	for (size_t i = 0; i < tableLen; i++) {
-		depTable[i] = NULL;	 // initialize
 		lua_rawgeti(L, 2, i + 1);
 		if (lua_isstring(L, -1)) {
 			const char* s = lua_tostring(L, -1);
-			depTable[i] = strdup(s);
-			if (!depTable[i]) {
-				// Cleanup on allocation failure
-				for (size_t j = 0; j < i; j++) free(depTable[j]);
-				free(depTable);
-				lua_pop(L, 1);
-				return luaL_error(L, "Memory allocation failed for dependency");
-			}
 			if (strchr(s, '%')) wildcard = 1;
+			depStrings[depCount++] = s;
 		}
 		lua_pop(L, 1);
 	}
 
+	if (unity && !wildcard) {
+		free(depStrings);
+		return luaL_error(L, "unity only applies to pattern recipes");
+	}
+
 	Recipe newRecipe = {0};
-	int luaFuncRef = luaL_ref(L, LUA_REGISTRYINDEX);  // store Lua function
+	newRecipe.deplen = (int)depCount;
+	newRecipe.dir = include_dir;
+	newRecipe.unity = (int)unity;
+	if (lua_isfunction(L, 3)) {
+		// store Lua function
+		newRecipe.function = luaL_ref(L, LUA_REGISTRYINDEX);
+		newRecipe.command = NULL;
+	} else {
+		newRecipe.function = LUA_NOREF;
+		newRecipe.command = arena_strdup(&graph_arena, lua_tostring(L, 3));
+	}
 
 	if (wildcard) {
-		newRecipe.target = NULL;
-		newRecipe.pattern_target = strdup(luaTarget);
-		if (!newRecipe.pattern_target) {
-			for (size_t i = 0; i < tableLen; i++) free(depTable[i]);
-			free(depTable);
-			return luaL_error(L, "Memory allocation failed for pattern_target");
-		}
-		newRecipe.dependencies = depTable;
-		newRecipe.pattern_deps =
-			depTable;  // safe as long as you never free independently
-		newRecipe.deplen = (int)tableLen;
-		newRecipe.function = luaFuncRef;
+		// Lua may collect the strings, so the patterns get their own copies
+		const char** patterns =
+			arena_alloc(&graph_arena, depCount * sizeof(*patterns));
+		for (size_t i = 0; i < depCount; i++)
+			patterns[i] = arena_strdup(
+				&graph_arena,
+				include_rebase(depStrings[i], depBuf, sizeof(depBuf)));
+		newRecipe.target = -1;
+		newRecipe.dependencies = NULL;
+		newRecipe.pattern_target = arena_strdup(&graph_arena, luaTarget);
+		newRecipe.pattern_deps = patterns;
 		newRecipe.is_wildcard = 1;
 	} else {
-		newRecipe.target = strdup(luaTarget);
-		if (!newRecipe.target) {
-			for (size_t i = 0; i < tableLen; i++) free(depTable[i]);
-			free(depTable);
-			return luaL_error(L, "Memory allocation failed for target");
-		}
-		newRecipe.dependencies = depTable;
+		int* deps = arena_alloc(&graph_arena, depCount * sizeof(*deps));
+		for (size_t i = 0; i < depCount; i++)
+			deps[i] = node_intern(
+				include_rebase(depStrings[i], depBuf, sizeof(depBuf)));
+		newRecipe.target = node_intern(luaTarget);
+		newRecipe.dependencies = deps;
 		newRecipe.pattern_target = NULL;
 		newRecipe.pattern_deps = NULL;
-		newRecipe.deplen = (int)tableLen;
-		newRecipe.function = luaFuncRef;
 		newRecipe.is_wildcard = 0;
 	}
 
+	free(depStrings);
 	recipe_add(newRecipe);
 	return 0;
 }
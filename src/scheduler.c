@@ -0,0 +1,298 @@
+#define _GNU_SOURCE  // pipe2
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bake.h"
+
+// Shell command recipes don't need Lua, so they run as jobs on their own
+// threads while the build walk carries on. Every -j slot runs commands
+// locally, every worker slot ships them to a bake-worker daemon. Threads only
+// touch their own slot; all graph and log state is updated on the main thread
+// when a job is reaped. Test shards (see tests.c) are jobs too, but always
+// run locally so their timeout can be enforced. With --cache, a job first
+// tries to fetch its output from the artifact cache (see cache.c).
+
+typedef struct {
+	int worker;	 // socket to a bake-worker, -1 for a local slot
+	int busy;
+	pthread_t thread;
+	size_t recipe;
+	int shard;	// test recipes only
+	int local;	// never sent to a worker, test shards aren't
+	double timeout;
+	const char* dir;  // sub-project the command runs in, NULL for the top
+	char* command;
+	const char** inputs;
+	int input_count;
+	const char* output;
+	char* trace_file;
+	char* traced_command;  // command wrapped for --trace, or NULL
+	int exit_code;
+	double duration;  // time the command itself took
+	int remote;	 // the job actually ran on the worker
+	int cacheable;
+	unsigned long cache_key[2];
+	int cached;	 // the output came from the artifact cache
+	LogBuffer log;
+} Slot;
+
+static Slot* slots = NULL;
+static int slot_count = 0;
+static int running = 0;
+static int failing = 0;	 // a job failed, nothing new starts
+static int done_pipe[2] = {-1, -1};
+
+static void scheduler_init(void) {
+	if (slots) return;
+
+	if (pipe2(done_pipe, O_CLOEXEC) != 0) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	int local = args.jobs > 0 ? args.jobs : 1;
+	slots = calloc(local + args.worker_count, sizeof(Slot));
+	if (!slots) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < local; i++) slots[slot_count++].worker = -1;
+
+	for (int i = 0; i < args.worker_count; i++) {
+		int fd = worker_connect(args.workers[i]);
+		if (fd < 0) {
+			print("\x1b[33mWarning: can't reach worker %s: %s\x1b[0m",
+				  args.workers[i], strerror(errno));
+			continue;
+		}
+		slots[slot_count++].worker = fd;
+	}
+}
+
+// Substitutes $@ (target), $< (first dependency), $^ (all dependencies)
+// and $$ into the recipe's command. Paths are relative to the recipe's
+// directory, which is where the command runs.
+char* command_expand(const Recipe* recipe) {
+	LogBuffer out = {NULL, 0, 0};
+	char rel[PATH_MAX];
+
+	for (const char* p = recipe->command; *p; p++) {
+		if (*p != '$' || !p[1]) {
+			log_buffer_append(&out, p, 1);
+			continue;
+		}
+		switch (*++p) {
+			case '@': {
+				const char* t = node_path(recipe->target);
+				t = path_from(recipe->dir, t, rel, sizeof(rel));
+				log_buffer_append(&out, t, strlen(t));
+				break;
+			}
+			case '<':
+			case '^': {
+				int first = 1;
+				for (int i = 0; i < recipe->deplen; i++) {
+					int dep = recipe->dependencies[i];
+					if (dep == NODE_ALWAYS) continue;
+					const char* d = path_from(recipe->dir, node_path(dep), rel,
+											  sizeof(rel));
+					if (!first) log_buffer_append(&out, " ", 1);
+					log_buffer_append(&out, d, strlen(d));
+					first = 0;
+					if (*p == '<') break;
+				}
+				break;
+			}
+			case '$':
+				log_buffer_append(&out, "$", 1);
+				break;
+			default:  // leave shell variables alone
+				log_buffer_append(&out, p - 1, 2);
+		}
+	}
+	log_buffer_append(&out, "", 1);
+	return out.data;
+}
+
+static void* job_thread(void* arg) {
+	Slot* s = arg;
+	int done = 0;
+	double start = now_seconds();
+
+	if (s->cacheable && !args.force)
+		s->cached = cache_fetch(s->cache_key, s->output);
+	if (!s->cached && s->worker >= 0 && !s->local) {
+		done = worker_run_job(s->worker, s->dir ? s->dir : "", s->command,
+							  s->inputs, s->input_count, &s->output, 1,
+							  &s->log, &s->exit_code);
+		if (!done) {
+			// the worker is gone, this slot runs locally from now on
+			close(s->worker);
+			s->worker = -1;
+			s->log.len = 0;
+		}
+	}
+	s->remote = done;
+	if (!done && !s->cached) {
+		// absolute, the main thread may be inside a sub-project right now
+		char cwd[PATH_MAX];
+		snprintf(cwd, sizeof(cwd), "%s/%s", project_root,
+				 s->dir ? s->dir : ".");
+		s->exit_code =
+			run_command(s->traced_command ? s->traced_command : s->command,
+						cwd, s->timeout, &s->log);
+	}
+	s->duration = now_seconds() - start;
+
+	int idx = (int)(s - slots);
+	while (write(done_pipe[1], &idx, sizeof(idx)) < 0 && errno == EINTR);
+	return NULL;
+}
+
+static void job_reap(Slot* s) {
+	pthread_join(s->thread, NULL);
+
+	Recipe* recipe = &recipe_arr.data[s->recipe];
+	node_stat_invalidate(recipe->target);
+	if (!s->remote && !s->cached) stats.spawns++;
+	stats.output_bytes += s->log.len;
+	if (recipe->shards) {
+		// failures end up in the summary, the other tests keep running
+		test_reap(s->recipe, s->shard, s->exit_code, s->duration, s->command,
+				  &s->log);
+		free(s->command);
+		free(s->inputs);
+		s->log.len = 0;
+		s->busy = 0;
+		running--;
+		return;
+	}
+
+	// the whole job goes out as one block, however many are running
+	LogBuffer block = {NULL, 0, 0};
+	log_capture(&block);
+	print("\x1b[34mBaking recipe \x1b[35m\"%s\"\x1b[0m%s",
+		  node_path(recipe->target),
+		  s->cached ? " (cached)" : s->remote ? " (remote)" : "");
+	indent_log(1);
+	print("\x1b[2;90m$ %s\x1b[0m", s->command);
+	size_t len = s->log.len;
+	while (len > 0 && s->log.data[len - 1] == '\n') len--;
+	if (len > 0) print("%.*s", (int)len, s->log.data);
+	if (s->exit_code != 0) {
+		print("\x1b[31mCommand failed with code %d\x1b[0m", s->exit_code);
+	}
+	indent_log(-1);
+	log_capture(NULL);
+	log_flush(&block);
+	log_buffer_free(&block);
+	trace_end(recipe, s->trace_file);	// remote jobs leave no trace
+
+	int failed = s->exit_code != 0;
+	progress_end(s->recipe);
+	if (!failed) {
+		// a download says nothing about how long the recipe takes
+		StateEntry* e = state_get(recipe->target);
+		double duration = s->duration;
+		if (s->cached && e && e->duration > 0) duration = e->duration;
+		state_record_build(recipe->target, duration, hash_string(s->command));
+
+		if (s->cached) {
+			stats.cache_hits++;
+		} else if (s->cacheable) {
+			stats.cache_misses++;
+			cache_upload(s->cache_key, node_path(recipe->target));
+		}
+	}
+	recipe->state = RECIPE_DONE;
+	free(s->command);
+	free(s->traced_command);
+	free(s->inputs);
+	s->log.len = 0;
+	s->busy = 0;
+	running--;
+	if (failed) failing = 1;  // the main loop exits once the rest wind down
+}
+
+// Blocks until any job finishes and reaps it
+static void scheduler_wait_one(void) {
+	double start = now_seconds();
+	int idx;
+	ssize_t n;
+	while ((n = read(done_pipe[0], &idx, sizeof(idx))) < 0 && errno == EINTR);
+	stats.job_wait_time += now_seconds() - start;
+	if (n != sizeof(idx)) {
+		perror("read");
+		exit(EXIT_FAILURE);
+	}
+	job_reap(&slots[idx]);
+}
+
+void scheduler_submit(size_t recipe, int shard) {
+	scheduler_init();
+	while (running == slot_count && !failing) scheduler_wait_one();
+	if (failing) scheduler_finish();
+
+	Slot* s = NULL;
+	for (int i = 0; i < slot_count && !s; i++) {
+		if (!slots[i].busy) s = &slots[i];
+	}
+
+	Recipe* r = &recipe_arr.data[recipe];
+	s->busy = 1;
+	s->recipe = recipe;
+	s->shard = shard;
+	s->local = r->shards != 0;
+	s->timeout = r->shards ? r->timeout : 0;
+	s->dir = r->dir;
+	s->command = r->shards ? test_command(r, shard) : command_expand(r);
+	s->output = node_path(r->target);
+	s->exit_code = 0;
+	s->remote = 0;
+	s->trace_file = r->shards ? NULL : trace_begin();
+	s->traced_command =
+		s->trace_file ? trace_wrap(s->command, s->trace_file) : NULL;
+	// traced jobs have to run to be traced
+	s->cached = 0;
+	s->cacheable = !s->trace_file && s->command &&
+				   cache_key(r, s->command, s->cache_key);
+
+	// workers get every dependency that is a plain file
+	s->inputs = malloc((r->deplen ? r->deplen : 1) * sizeof(*s->inputs));
+	s->input_count = 0;
+	for (int i = 0; s->inputs && i < r->deplen; i++) {
+		int dep = r->dependencies[i];
+		if (dep != NODE_ALWAYS && node_stat(dep) == NODE_FILE)
+			s->inputs[s->input_count++] = node_path(dep);
+	}
+	if (!s->command || !s->inputs) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	r->state = RECIPE_RUNNING;
+	running++;
+	if (shard == 0) progress_begin(recipe);	 // test shards run as one
+	if (pthread_create(&s->thread, NULL, job_thread, s) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void scheduler_wait(const Recipe* recipe) {
+	while (recipe->state == RECIPE_RUNNING && !failing) scheduler_wait_one();
+	if (failing) scheduler_finish();
+}
+
+// Waits for every job, and exits if one of them failed
+void scheduler_finish(void) {
+	while (running > 0) scheduler_wait_one();
+	if (failing) exit(EXIT_FAILURE);
+}
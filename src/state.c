@@ -0,0 +1,210 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "bake.h"
+
+// .bake/state is line based: "T <target>" starts a target's record and the
+// lines after it belong to that target.
+//
+//   D <path>	an input discovered by tracing
+//   R <secs>	how long the recipe took the last time it succeeded
+//   O <mtime>	Bake produced the target file, this is its mtime
+//   C <hash>	hash of the expanded command of a command recipe
+//   P <key>	a test recipe passed with inputs hashing to key
+//
+// The targets with an O line make up the output manifest: --clean and
+// --prune only ever delete those.
+
+#define STATE_FILE STATE_DIR "/state"
+#define STATE_HEADER "bake-state 1"
+
+StateArray state_arr = {NULL, 0, 0};
+static int dirty = 0;
+
+StateEntry* state_get(int node) {
+	int idx = node_arr.data[node].state;
+	return idx < 0 ? NULL : &state_arr.data[idx];
+}
+
+StateEntry* state_entry(int node) {
+	StateEntry* e = state_get(node);
+	if (e) return e;
+
+	if (state_arr.count >= state_arr.capacity) {
+		size_t new_cap = state_arr.capacity ? state_arr.capacity * 2 : 64;
+		StateEntry* tmp = realloc(state_arr.data, new_cap * sizeof(*tmp));
+		if (!tmp) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		state_arr.data = tmp;
+		state_arr.capacity = new_cap;
+	}
+
+	e = &state_arr.data[state_arr.count];
+	memset(e, 0, sizeof(*e));
+	e->target = node;
+	node_arr.data[node].state = (int)state_arr.count++;
+	return e;
+}
+
+void state_set_discovered(StateEntry* e, const int* deps, int count) {
+	if (count == e->discovered_count &&
+		memcmp(deps, e->discovered, count * sizeof(int)) == 0)
+		return;
+
+	// old lists stay in the arena until exit, they're small
+	e->discovered = arena_alloc(&graph_arena, count * sizeof(int));
+	memcpy(e->discovered, deps, count * sizeof(int));
+	e->discovered_count = count;
+	dirty = 1;
+}
+
+// A recipe for target just succeeded: remember how long it took, the command
+// it ran (0 for Lua recipes) and, if it left a file behind, that the file is
+// one of ours
+void state_record_build(int target, double seconds,
+						unsigned long command_hash) {
+	StateEntry* e = state_entry(target);
+	e->duration = seconds;
+	e->command_hash = command_hash;
+	if (node_stat(target) == NODE_FILE)
+		e->output_mtime = node_arr.data[target].mtime;
+	dirty = 1;
+}
+
+void state_set_output(StateEntry* e, time_t mtime) {
+	e->output_mtime = mtime;
+	dirty = 1;
+}
+
+void state_set_test_pass(StateEntry* e, unsigned long key) {
+	e->test_pass = key;
+	dirty = 1;
+}
+
+void state_forget(StateEntry* e) {
+	e->discovered_count = 0;
+	e->duration = 0;
+	e->output_mtime = 0;
+	e->command_hash = 0;
+	e->test_pass = 0;
+	dirty = 1;
+}
+
+void state_load(void) {
+	FILE* f = fopen(STATE_FILE, "r");
+	if (!f) return;
+
+	char* line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	StateEntry* e = NULL;
+	int* deps = NULL;
+	size_t dep_count = 0, dep_cap = 0;
+
+	if ((len = getline(&line, &cap, f)) < 0 ||
+		strncmp(line, STATE_HEADER, strlen(STATE_HEADER)) != 0) {
+		print("\x1b[33mWarning: ignoring unknown %s\x1b[0m", STATE_FILE);
+		free(line);
+		fclose(f);
+		return;
+	}
+
+	// one extra iteration at EOF to flush the last record
+	for (;;) {
+		len = getline(&line, &cap, f);
+		if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+		int record_end = len < 0 || (len > 2 && line[0] == 'T');
+
+		if (record_end && e) {
+			state_set_discovered(e, deps, (int)dep_count);
+			dep_count = 0;
+		}
+		if (len < 0) break;
+		if (len < 2 || line[1] != ' ') continue;
+
+		const char* value = line + 2;
+		switch (line[0]) {
+			case 'T':
+				e = state_entry(node_intern(value));
+				break;
+			case 'D':
+				if (!e) break;
+				if (dep_count >= dep_cap) {
+					dep_cap = dep_cap ? dep_cap * 2 : 16;
+					int* tmp = realloc(deps, dep_cap * sizeof(*deps));
+					if (!tmp) {
+						perror("realloc");
+						exit(EXIT_FAILURE);
+					}
+					deps = tmp;
+				}
+				deps[dep_count++] = node_intern(value);
+				break;
+			case 'R':
+				if (e) e->duration = strtod(value, NULL);
+				break;
+			case 'O':
+				if (e) e->output_mtime = (time_t)strtoll(value, NULL, 10);
+				break;
+			case 'C':
+				if (e) e->command_hash = strtoul(value, NULL, 16);
+				break;
+			case 'P':
+				if (e) e->test_pass = strtoul(value, NULL, 16);
+				break;
+		}
+	}
+
+	free(deps);
+	free(line);
+	fclose(f);
+	dirty = 0;	// everything so far came from disk
+}
+
+void state_free(void) {
+	free(state_arr.data);
+	state_arr.data = NULL;
+	state_arr.count = state_arr.capacity = 0;
+	dirty = 0;
+}
+
+void state_save(void) {
+	if (!dirty) return;
+
+	if (mkdir(STATE_DIR, 0755) != 0 && errno != EEXIST) return;
+	FILE* f = fopen(STATE_FILE ".tmp", "w");
+	if (!f) {
+		print("\x1b[31mCould not write %s: %s\x1b[0m", STATE_FILE,
+			  strerror(errno));
+		return;
+	}
+
+	fprintf(f, "%s\n", STATE_HEADER);
+	for (size_t i = 0; i < state_arr.count; i++) {
+		StateEntry* e = &state_arr.data[i];
+		if (!e->discovered_count && e->duration <= 0 && !e->output_mtime &&
+			!e->command_hash && !e->test_pass)
+			continue;  // forgotten, e.g. cleaned outputs of gone recipes
+		fprintf(f, "T %s\n", node_path(e->target));
+		for (int j = 0; j < e->discovered_count; j++)
+			fprintf(f, "D %s\n", node_path(e->discovered[j]));
+		if (e->duration > 0) fprintf(f, "R %.3f\n", e->duration);
+		if (e->output_mtime)
+			fprintf(f, "O %lld\n", (long long)e->output_mtime);
+		if (e->command_hash) fprintf(f, "C %016lx\n", e->command_hash);
+		if (e->test_pass) fprintf(f, "P %016lx\n", e->test_pass);
+	}
+
+	// rename last, an interrupted save leaves the old state intact
+	if (fclose(f) != 0 || rename(STATE_FILE ".tmp", STATE_FILE) != 0) {
+		print("\x1b[31mCould not write %s: %s\x1b[0m", STATE_FILE,
+			  strerror(errno));
+		return;
+	}
+	dirty = 0;
+}
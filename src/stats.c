@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "bake.h"
+
+BakeStats stats;
+
+double now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long peak_rss_kib(void) {
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+	return ru.ru_maxrss;  // already KiB on Linux
+}
+
+static double clamp(double t) { return t > 0 ? t : 0; }
+
+// Time spent evaluating the bakefile itself, without the build it triggers
+static double lua_eval_time(void) {
+	return clamp(stats.eval_time - stats.expand_time - stats.build_time);
+}
+
+// All time spent running Lua, bakefile and recipe functions, minus children
+static double lua_time(void) {
+	return clamp(lua_eval_time() + stats.recipe_time - stats.child_time);
+}
+
+static double bake_time(void) {
+	return clamp(stats.total_time - lua_time() - stats.child_time -
+				 stats.job_wait_time);
+}
+
+void stats_print(void) {
+	print("\x1b[33mStatistics:\x1b[0m");
+	indent_log(1);
+	print("Targets:          %ld checked, %ld built, %ld fresh",
+		  stats.targets_checked, stats.targets_built, stats.targets_fresh);
+	print("stat calls:       %ld (%ld cache hits)", stats.stat_calls,
+		  stats.stat_cache_hits);
+	print("Processes:        %ld spawned, %ld bytes of output",
+		  stats.spawns, stats.output_bytes);
+	print("Whisk cache:      %ld hits, %ld misses", stats.whisk_cache_hits,
+		  stats.whisk_cache_misses);
+	print("Artifact cache:   %ld hits, %ld misses, %ld uploaded",
+		  stats.cache_hits, stats.cache_misses, stats.cache_uploads);
+	print("Total time:       %.3fs", stats.total_time);
+	print("  Lua:            %.3fs (%.3fs evaluating the bakefile)",
+		  lua_time(), lua_eval_time());
+	print("  Children:       %.3fs", stats.child_time);
+	print("  Job waits:      %.3fs", stats.job_wait_time);
+	print("  Bake:           %.3fs", bake_time());
+	print("Wildcard expand:  %.3fs", stats.expand_time);
+	print("pantry.collect:   %.3fs", stats.collect_time);
+	print("Build:            %.3fs", stats.build_time);
+	print("Peak RSS:         %ld KiB", peak_rss_kib());
+	print("Graph memory:     %.1f KiB (%zu nodes, %zu recipes)",
+		  recipes_memory() / 1024.0, node_arr.count, recipe_arr.count);
+	indent_log(-1);
+}
+
+int stats_write_json(const char* path) {
+	FILE* f = fopen(path, "w");
+	if (!f) return 0;
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"total_time\": %.6f,\n", stats.total_time);
+	fprintf(f, "  \"lua_time\": %.6f,\n", lua_time());
+	fprintf(f, "  \"lua_eval_time\": %.6f,\n", lua_eval_time());
+	fprintf(f, "  \"child_time\": %.6f,\n", stats.child_time);
+	fprintf(f, "  \"job_wait_time\": %.6f,\n", stats.job_wait_time);
+	fprintf(f, "  \"bake_time\": %.6f,\n", bake_time());
+	fprintf(f, "  \"expand_time\": %.6f,\n", stats.expand_time);
+	fprintf(f, "  \"collect_time\": %.6f,\n", stats.collect_time);
+	fprintf(f, "  \"build_time\": %.6f,\n", stats.build_time);
+	fprintf(f, "  \"targets_checked\": %ld,\n", stats.targets_checked);
+	fprintf(f, "  \"targets_built\": %ld,\n", stats.targets_built);
+	fprintf(f, "  \"targets_fresh\": %ld,\n", stats.targets_fresh);
+	fprintf(f, "  \"stat_calls\": %ld,\n", stats.stat_calls);
+	fprintf(f, "  \"stat_cache_hits\": %ld,\n", stats.stat_cache_hits);
+	fprintf(f, "  \"spawns\": %ld,\n", stats.spawns);
+	fprintf(f, "  \"output_bytes\": %ld,\n", stats.output_bytes);
+	fprintf(f, "  \"whisk_cache_hits\": %ld,\n", stats.whisk_cache_hits);
+	fprintf(f, "  \"whisk_cache_misses\": %ld,\n", stats.whisk_cache_misses);
+	fprintf(f, "  \"cache_hits\": %ld,\n", stats.cache_hits);
+	fprintf(f, "  \"cache_misses\": %ld,\n", stats.cache_misses);
+	fprintf(f, "  \"cache_uploads\": %ld,\n", stats.cache_uploads);
+	fprintf(f, "  \"peak_rss_kib\": %ld,\n", peak_rss_kib());
+	fprintf(f, "  \"graph_memory\": %zu,\n", recipes_memory());
+	fprintf(f, "  \"nodes\": %zu,\n", node_arr.count);
+	fprintf(f, "  \"recipes\": %zu\n", recipe_arr.count);
+	fprintf(f, "}\n");
+
+	return fclose(f) == 0;
+}
+
+static void metric(FILE* f, const char* name, const char* type,
+				   const char* help, double value) {
+	fprintf(f, "# HELP bake_%s %s\n", name, help);
+	fprintf(f, "# TYPE bake_%s %s\n", name, type);
+	fprintf(f, "bake_%s %.17g\n", name, value);
+}
+
+// Prometheus text exposition format, meant for the node exporter's
+// textfile collector on CI runners.
+int stats_write_metrics(const char* path) {
+	FILE* f = fopen(path, "w");
+	if (!f) return 0;
+
+	metric(f, "targets_checked_total", "counter",
+		   "Targets whose freshness was checked.", stats.targets_checked);
+	metric(f, "targets_built_total", "counter",
+		   "Targets whose recipe was run.", stats.targets_built);
+	metric(f, "targets_fresh_total", "counter",
+		   "Targets that were already up to date.", stats.targets_fresh);
+	metric(f, "stat_calls_total", "counter", "stat(2) calls made by Bake.",
+		   stats.stat_calls);
+	metric(f, "stat_cache_hits_total", "counter",
+		   "File metadata lookups served from the stat cache.",
+		   stats.stat_cache_hits);
+	metric(f, "process_spawns_total", "counter",
+		   "Processes started by Bake (whisk and local jobs).",
+		   stats.spawns);
+	metric(f, "output_bytes_total", "counter",
+		   "Bytes of command output captured.", stats.output_bytes);
+	metric(f, "whisk_cache_hits_total", "counter",
+		   "Cached whisk results replayed instead of run.",
+		   stats.whisk_cache_hits);
+	metric(f, "whisk_cache_misses_total", "counter",
+		   "Cached whisk commands that had to run.", stats.whisk_cache_misses);
+	metric(f, "cache_hits_total", "counter",
+		   "Command recipes served from the artifact cache.", stats.cache_hits);
+	metric(f, "cache_misses_total", "counter",
+		   "Cacheable command recipes that had to run.", stats.cache_misses);
+	metric(f, "cache_uploads_total", "counter",
+		   "Artifacts uploaded to the artifact cache.", stats.cache_uploads);
+
+	fprintf(f, "# HELP bake_time_seconds Wall time of the run by consumer.\n");
+	fprintf(f, "# TYPE bake_time_seconds gauge\n");
+	fprintf(f, "bake_time_seconds{part=\"lua\"} %.6f\n", lua_time());
+	fprintf(f, "bake_time_seconds{part=\"children\"} %.6f\n",
+			stats.child_time);
+	fprintf(f, "bake_time_seconds{part=\"jobs\"} %.6f\n",
+			stats.job_wait_time);
+	fprintf(f, "bake_time_seconds{part=\"bake\"} %.6f\n", bake_time());
+	metric(f, "total_time_seconds", "gauge", "Wall time of the whole run.",
+		   stats.total_time);
+	metric(f, "peak_rss_bytes", "gauge", "Peak resident set size.",
+		   peak_rss_kib() * 1024.0);
+
+	return fclose(f) == 0;
+}
@@ -0,0 +1,270 @@
+#include <lua5.3/lauxlib.h>
+#include <lua5.3/lua.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bake.h"
+
+// test(name, deps, command [, {timeout = secs, shards = n}]) declares a test
+// recipe. Instead of re-running like an ALWAYS recipe, a test is skipped if
+// it passed before with the same command and the same contents of all of its
+// dependencies (the test binary and its data). Tests that do run are split
+// into shards, each one a job with its own timeout; every shard gets
+// TEST_SHARD_INDEX and TEST_TOTAL_SHARDS (and the GTEST_ spellings) so the
+// binary can pick its part. A failing test only stops what depends on it, the
+// rest of the build goes on. Every test shows up in the summary table at the
+// end, and a failed one makes bake exit non-zero.
+
+#define TEST_DEFAULT_TIMEOUT 300.0
+
+enum { TEST_PASS, TEST_FAIL, TEST_TIMEOUT, TEST_CACHED };
+
+typedef struct {
+	size_t recipe;
+	int outcome;
+	int shards_left;
+	double duration;  // of the slowest shard
+	unsigned long key;
+} TestResult;
+
+static TestResult* results = NULL;
+static size_t result_count = 0;
+static size_t result_cap = 0;
+static int* result_of = NULL;  // recipe index -> results index + 1
+static size_t result_of_count = 0;
+
+int l_test(lua_State* L) {
+	const char* name = luaL_checkstring(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	const char* command = luaL_checkstring(L, 3);
+	double timeout = TEST_DEFAULT_TIMEOUT;
+	lua_Integer shards = 1;
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		lua_getfield(L, 4, "timeout");
+		timeout = luaL_optnumber(L, -1, TEST_DEFAULT_TIMEOUT);
+		lua_getfield(L, 4, "shards");
+		shards = luaL_optinteger(L, -1, 1);
+		lua_pop(L, 2);
+	}
+	if (shards < 1 || shards > 1000)
+		return luaL_error(L, "shards must be between 1 and 1000");
+	if (timeout < 0) return luaL_error(L, "timeout can't be negative");
+
+	char buf[PATH_MAX];
+	size_t len = lua_rawlen(L, 2);
+	Recipe recipe = {0};
+	recipe.dependencies =
+		arena_alloc(&graph_arena, (len ? len : 1) * sizeof(int));
+	for (size_t i = 0; i < len; i++) {
+		lua_rawgeti(L, 2, i + 1);
+		if (lua_isstring(L, -1)) {
+			const char* dep = include_rebase(lua_tostring(L, -1), buf,
+											 sizeof(buf));
+			recipe.dependencies[recipe.deplen++] = node_intern(dep);
+		}
+		lua_pop(L, 1);
+	}
+	recipe.target = node_intern(include_rebase(name, buf, sizeof(buf)));
+	recipe.function = LUA_NOREF;
+	recipe.command = arena_strdup(&graph_arena, command);
+	recipe.dir = include_dir;
+	recipe.shards = (int)shards;
+	recipe.timeout = timeout;
+	recipe_add(recipe);
+	return 0;
+}
+
+// What a pass is cached under: the command, the sharding and the contents of
+// every dependency
+static unsigned long test_key(const Recipe* recipe) {
+	char* command = command_expand(recipe);
+	unsigned long h = hash_string(command ? command : "");
+	free(command);
+	h = hash_bytes(h, &recipe->shards, sizeof(recipe->shards));
+	for (int i = 0; i < recipe->deplen; i++) {
+		int dep = recipe->dependencies[i];
+		if (dep == NODE_ALWAYS) continue;
+		const char* path = node_path(dep);
+		h = hash_bytes(h, path, strlen(path) + 1);
+		if (node_stat(dep) == NODE_FILE) h = hash_file(h, path);
+	}
+	return h;
+}
+
+static TestResult* result_add(size_t recipe) {
+	if (result_of_count < recipe_arr.count) {
+		int* tmp = realloc(result_of, recipe_arr.count * sizeof(int));
+		if (!tmp) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		memset(tmp + result_of_count, 0,
+			   (recipe_arr.count - result_of_count) * sizeof(int));
+		result_of = tmp;
+		result_of_count = recipe_arr.count;
+	}
+	if (result_count == result_cap) {
+		size_t new_cap = result_cap ? result_cap * 2 : 64;
+		TestResult* tmp = realloc(results, new_cap * sizeof(*tmp));
+		if (!tmp) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		results = tmp;
+		result_cap = new_cap;
+	}
+	TestResult* r = &results[result_count];
+	memset(r, 0, sizeof(*r));
+	r->recipe = recipe;
+	result_of[recipe] = (int)++result_count;
+	return r;
+}
+
+// Called by the build walk once the test's dependencies are built
+void test_start(Recipe* recipe) {
+	const char* name = node_path(recipe->target);
+	size_t idx = recipe - recipe_arr.data;
+	StateEntry* state = state_get(recipe->target);
+	stats.targets_checked++;
+
+	unsigned long key = test_key(recipe);
+	if (!args.force && state && state->test_pass == key) {
+		print("\x1b[35m\"%s\"\x1b[32m passed before, serving...\x1b[0m",
+			  name);
+		stats.targets_fresh++;
+		if (!args.dry_run) result_add(idx)->outcome = TEST_CACHED;
+		return;
+	}
+	stats.targets_built++;
+	recipe->rebuilt = 1;
+	if (args.explain) {
+		print("\x1b[36m\"%s\": %s\x1b[0m", name,
+			  args.force ? "forced by -B"
+						 : "no passing run with these inputs");
+	}
+	if (args.dry_run) {
+		print("\x1b[34mWould run test \x1b[35m\"%s\"\x1b[0m", name);
+		return;
+	}
+
+	TestResult* r = result_add(idx);
+	r->outcome = TEST_PASS;
+	r->shards_left = recipe->shards;
+	r->key = key;
+	for (int i = 0; i < recipe->shards; i++) scheduler_submit(idx, i);
+}
+
+// The expanded command, with the shard variables in front
+char* test_command(const Recipe* recipe, int shard) {
+	char* command = command_expand(recipe);
+	if (!command) return NULL;
+
+	const char* fmt =
+		"TEST_SHARD_INDEX=%d TEST_TOTAL_SHARDS=%d GTEST_SHARD_INDEX=%d "
+		"GTEST_TOTAL_SHARDS=%d; export TEST_SHARD_INDEX TEST_TOTAL_SHARDS "
+		"GTEST_SHARD_INDEX GTEST_TOTAL_SHARDS; %s";
+	size_t len = strlen(fmt) + strlen(command) + 64;
+	char* out = malloc(len);
+	if (out) {
+		snprintf(out, len, fmt, shard, recipe->shards, shard, recipe->shards,
+				 command);
+	}
+	free(command);
+	return out;
+}
+
+void test_reap(size_t recipe, int shard, int exit_code, double seconds,
+			   const char* command, LogBuffer* log) {
+	Recipe* rec = &recipe_arr.data[recipe];
+	TestResult* r = &results[result_of[recipe] - 1];
+	const char* name = node_path(rec->target);
+	char label[32] = "";
+	if (rec->shards > 1)
+		snprintf(label, sizeof(label), " (shard %d/%d)", shard + 1,
+				 rec->shards);
+
+	if (exit_code == 0) {
+		print("\x1b[32mPASS\x1b[0m \x1b[35m\"%s\"\x1b[0m%s %.2fs", name, label,
+			  seconds);
+	} else {
+		// only failures are worth their output
+		LogBuffer block = {NULL, 0, 0};
+		log_capture(&block);
+		print("\x1b[31m%s\x1b[0m \x1b[35m\"%s\"\x1b[0m%s %.2fs",
+			  exit_code == RUN_TIMED_OUT ? "TIMEOUT" : "FAIL", name, label,
+			  seconds);
+		indent_log(1);
+		print("\x1b[2;90m$ %s\x1b[0m", command);
+		size_t len = log->len;
+		while (len > 0 && log->data[len - 1] == '\n') len--;
+		if (len > 0) print("%.*s", (int)len, log->data);
+		if (exit_code == RUN_TIMED_OUT) {
+			print("\x1b[31mKilled after %gs\x1b[0m", rec->timeout);
+		} else {
+			print("\x1b[31mCommand failed with code %d\x1b[0m", exit_code);
+		}
+		indent_log(-1);
+		log_capture(NULL);
+		log_flush(&block);
+		log_buffer_free(&block);
+	}
+
+	if (exit_code == RUN_TIMED_OUT)
+		r->outcome = TEST_TIMEOUT;
+	else if (exit_code != 0 && r->outcome == TEST_PASS)
+		r->outcome = TEST_FAIL;
+	if (seconds > r->duration) r->duration = seconds;
+
+	// the plan counts the test once, however many shards it has
+	if (--r->shards_left > 0) return;
+	progress_end(recipe);
+	rec->state = RECIPE_DONE;
+	if (r->outcome == TEST_PASS) {
+		state_record_build(rec->target, r->duration, 0);
+		state_set_test_pass(state_entry(rec->target), r->key);
+	} else {
+		rec->failed = 1;  // what depends on it is skipped
+	}
+}
+
+int tests_summary(void) {
+	if (result_count == 0) return 0;
+
+	static const char* labels[] = {"\x1b[32mPASS   ", "\x1b[31mFAIL   ",
+								   "\x1b[31mTIMEOUT", "\x1b[32mCACHED "};
+	int width = 0;
+	int counts[4] = {0};
+	for (size_t i = 0; i < result_count; i++) {
+		const char* name = node_path(recipe_arr.data[results[i].recipe].target);
+		if ((int)strlen(name) > width) width = (int)strlen(name);
+	}
+	if (width > 60) width = 60;
+
+	print("\x1b[33mTests:\x1b[0m");
+	indent_log(1);
+	for (size_t i = 0; i < result_count; i++) {
+		TestResult* r = &results[i];
+		const char* name = node_path(recipe_arr.data[r->recipe].target);
+		counts[r->outcome]++;
+		if (r->outcome == TEST_CACHED) {
+			print("%s\x1b[0m  %-*s", labels[r->outcome], width, name);
+		} else {
+			print("%s\x1b[0m  %-*s %8.2fs", labels[r->outcome], width, name,
+				  r->duration);
+		}
+	}
+	print("\x1b[33m%d passed (%d cached), %d failed, %d timed out\x1b[0m",
+		  counts[TEST_PASS] + counts[TEST_CACHED], counts[TEST_CACHED],
+		  counts[TEST_FAIL], counts[TEST_TIMEOUT]);
+	indent_log(-1);
+
+	int failed = counts[TEST_FAIL] + counts[TEST_TIMEOUT];
+	free(results);
+	results = NULL;
+	result_count = result_cap = 0;
+	memset(result_of, 0, result_of_count * sizeof(int));
+	return failed;
+}
@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bake.h"
+
+// --trace runs commands with libbaketrace.so preloaded (see shim/trace.c),
+// which logs every file they touch. Files inside the project that a recipe
+// read but didn't declare become discovered dependencies in the state.
+
+const char* trace_current = NULL;
+
+static char* shim = NULL;
+static unsigned trace_seq = 0;
+
+int trace_init(void) {
+	const char* env = getenv("BAKE_TRACE_SHIM");
+	if (env) {
+		shim = realpath(env, NULL);
+	} else {
+		// installed next to the bake binary
+		char exe[PATH_MAX];
+		ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+		if (n > 0) {
+			exe[n] = '\0';
+			char* slash = strrchr(exe, '/');
+			if (slash) {
+				strcpy(slash + 1, "libbaketrace.so");
+				shim = realpath(exe, NULL);
+			}
+		}
+	}
+	if (!shim) {
+		print(
+			"\x1b[31m--trace needs libbaketrace.so next to bake or in "
+			"$BAKE_TRACE_SHIM\x1b[0m");
+		return 0;
+	}
+
+	if (mkdir(STATE_DIR, 0755) != 0 && errno != EEXIST) return 0;
+	return 1;
+}
+
+char* trace_begin(void) {
+	if (!args.trace) return NULL;
+
+	char* path = malloc(PATH_MAX);
+	if (!path) return NULL;
+	snprintf(path, PATH_MAX, "%s/%s/trace.%d.%u", project_root, STATE_DIR,
+			 (int)getpid(), trace_seq++);
+	unlink(path);  // left over from a crashed run with the same pid
+	return path;
+}
+
+char* trace_wrap(const char* cmd, const char* trace_file) {
+	const char* fmt =
+		"LD_PRELOAD='%s' BAKE_TRACE_FILE='%s'; "
+		"export LD_PRELOAD BAKE_TRACE_FILE; %s";
+	size_t len = strlen(fmt) + strlen(shim) + strlen(trace_file) + strlen(cmd);
+	char* out = malloc(len);
+	if (out) snprintf(out, len, fmt, shim, trace_file, cmd);
+	return out;
+}
+
+// Turns an absolute path inside the project into a normalized relative
+// one. Returns 0 for paths outside the project.
+static int project_path(char* path) {
+	size_t len = strlen(project_root);
+	if (strncmp(path, project_root, len) != 0 || path[len] != '/') return 0;
+
+	memmove(path, path + len + 1, strlen(path + len + 1) + 1);
+	normalize_path(path);
+	return strcmp(path, ".") != 0 && strcmp(path, "..") != 0 &&
+		   strncmp(path, "../", 3) != 0;
+}
+
+static int contains(const int* ids, int count, int id) {
+	for (int i = 0; i < count; i++) {
+		if (ids[i] == id) return 1;
+	}
+	return 0;
+}
+
+static int add_id(int** ids, int* count, int id) {
+	if (contains(*ids, *count, id)) return 1;
+	int* tmp = realloc(*ids, (*count + 1) * sizeof(int));
+	if (!tmp) return 0;
+	*ids = tmp;
+	(*ids)[(*count)++] = id;
+	return 1;
+}
+
+void trace_end(Recipe* recipe, char* trace_file) {
+	if (!trace_file) return;
+
+	size_t len;
+	char* data = read_file(trace_file, &len);
+	unlink(trace_file);
+	free(trace_file);
+	if (!data) return;	// the command touched nothing at all
+
+	int* read_ids = NULL;  // opened or stat'ed
+	int* opened_ids = NULL;	 // opened or executed
+	int* written_ids = NULL;
+	int read_count = 0, opened_count = 0, written_count = 0;
+
+	for (char* line = strtok(data, "\n"); line; line = strtok(NULL, "\n")) {
+		if (strlen(line) < 3 || line[1] != ' ') continue;
+		char kind = line[0];
+		char* path = line + 2;
+		if (!project_path(path)) continue;
+		if (strncmp(path, STATE_DIR "/", strlen(STATE_DIR) + 1) == 0) continue;
+
+		int id = node_intern(path);
+		int ok;
+		if (kind == 'w') {
+			ok = add_id(&written_ids, &written_count, id);
+		} else {
+			ok = add_id(&read_ids, &read_count, id);
+			if (ok && kind != 's') ok = add_id(&opened_ids, &opened_count, id);
+		}
+		if (!ok) break;
+	}
+
+	// keep plain files that the command didn't produce itself. Stat'ed ones
+	// count too, but only opened ones are warned about, once per target.
+	StateEntry* known = state_get(recipe->target);
+	int discovered = 0;
+	for (int i = 0; i < read_count; i++) {
+		int id = read_ids[i];
+		if (id == recipe->target || contains(written_ids, written_count, id))
+			continue;
+		node_stat_invalidate(id);
+		if (node_stat(id) != NODE_FILE) continue;
+
+		if (contains(recipe->dependencies, recipe->deplen, id)) continue;
+		if (contains(opened_ids, opened_count, id) &&
+			!(known &&
+			  contains(known->discovered, known->discovered_count, id)))
+			print("\x1b[33mWarning: \"%s\" read undeclared input \"%s\"\x1b[0m",
+				  node_path(recipe->target), node_path(id));
+		read_ids[discovered++] = id;
+	}
+
+	if (discovered > 0 || known)
+		state_set_discovered(state_entry(recipe->target), read_ids,
+							 discovered);
+	free(read_ids);
+	free(opened_ids);
+	free(written_ids);
+	free(data);
+}
@@ -0,0 +1,204 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bake.h"
+
+// recipe("build/%.o", {"src/%.c"}, cmd, {unity = 16}) compiles the sources
+// in groups of about 16 instead of one by one: each group is a generated
+// .bake/unity/*.c that #includes its members, so shared headers are parsed
+// once per group. A source's group comes from a hash of its stem and the
+// group count only changes when the number of sources doubles, so editing a
+// file rebuilds just its group. Whatever depended on a member's object
+// depends on its group's object instead, $^ and Lua recipes' deps included.
+
+#define UNITY_DIR STATE_DIR "/unity"
+
+typedef struct {
+	unsigned long group;
+	const char* stem;
+} Member;
+
+static int* substitute = NULL;	// node -> its group's object node, or -1
+static size_t substitute_count = 0;
+
+static void substitute_set(int node, int group) {
+	if ((size_t)node >= substitute_count) {
+		size_t count = node_arr.count;	// node is interned, so it's in there
+		int* tmp = realloc(substitute, count * sizeof(int));
+		if (!tmp) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		for (size_t i = substitute_count; i < count; i++) tmp[i] = -1;
+		substitute = tmp;
+		substitute_count = count;
+	}
+	substitute[node] = group;
+}
+
+static int member_cmp(const void* a, const void* b) {
+	const Member* x = a;
+	const Member* y = b;
+	if (x->group != y->group) return x->group < y->group ? -1 : 1;
+	return strcmp(x->stem, y->stem);
+}
+
+// Rewrites the generated source only if its members changed, its mtime is
+// what tells the group's object to rebuild
+static void write_unity_source(const char* path, const char* target_pattern,
+							   const char* source_pattern, const Member* m,
+							   size_t count) {
+	size_t cap = 256, len = 0;
+	char* text = malloc(cap);
+	char rel[PATH_MAX], source[PATH_MAX];
+	for (size_t i = 0; text && i <= count; i++) {
+		char line[PATH_MAX + 64];
+		int n;
+		if (i == 0) {
+			n = snprintf(line, sizeof(line),
+						 "// Generated by bake, unity build for %s\n",
+						 target_pattern);
+		} else {
+			size_t stem_len = strlen(m[i - 1].stem);
+			if (!pattern_fill(source, sizeof(source), source_pattern,
+							  m[i - 1].stem, stem_len))
+				continue;
+			n = snprintf(line, sizeof(line), "#include \"%s\"\n",
+						 path_from(UNITY_DIR, source, rel, sizeof(rel)));
+		}
+		while (len + n + 1 > cap) {
+			cap *= 2;
+			char* tmp = realloc(text, cap);
+			if (!tmp) free(text);
+			text = tmp;
+			if (!text) break;
+		}
+		if (!text) break;
+		memcpy(text + len, line, n + 1);
+		len += n;
+	}
+	if (!text) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	size_t old_len;
+	char* old = read_file(path, &old_len);
+	int same = old && old_len == len && memcmp(old, text, len) == 0;
+	free(old);
+	if (!same) {
+		FILE* f = mkdir_parents(path) ? fopen(path, "w") : NULL;
+		if (!f || fwrite(text, 1, len, f) != len || fclose(f) != 0) {
+			print("\x1b[31mCould not write %s\x1b[0m", path);
+			exit(EXIT_FAILURE);
+		}
+		node_stat_invalidate(node_intern(path));
+	}
+	free(text);
+}
+
+// Adds one recipe per group in place of the per-stem recipes expansion
+// would have added. stems are the stems the pattern matched.
+void unity_expand(const Recipe* pattern, const char* source_pattern,
+				  const char** stems, size_t count) {
+	if (count == 0) return;
+	size_t groups = 1;
+	while (groups * pattern->unity < count) groups *= 2;
+
+	Member* members = malloc(count * sizeof(*members));
+	if (!members) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < count; i++)
+		members[i] = (Member){hash_string(stems[i]) & (groups - 1), stems[i]};
+	qsort(members, count, sizeof(*members), member_cmp);
+
+	// patterns sharing an output directory get different group names
+	unsigned long tag = hash_string(pattern->pattern_target);
+	tag = hash_bytes(tag, source_pattern, strlen(source_pattern)) & 0xffff;
+	const char* base = strrchr(source_pattern, '/');
+	const char* suffix = strchr(base ? base : source_pattern, '%') + 1;
+
+	char path[PATH_MAX], name[64];
+	for (size_t first = 0, last; first < count; first = last) {
+		last = first + 1;
+		while (last < count && members[last].group == members[first].group)
+			last++;
+		size_t size = last - first;
+
+		snprintf(path, sizeof(path), "%s/%04lx-%lu%s", UNITY_DIR, tag,
+				 members[first].group, suffix);
+		if (!args.dry_run)
+			write_unity_source(path, pattern->pattern_target, source_pattern,
+							   &members[first], size);
+
+		Recipe group = {0};
+		group.dependencies = arena_alloc(
+			&graph_arena, (1 + size * pattern->deplen) * sizeof(int));
+		group.dependencies[group.deplen++] = node_intern(path);
+		for (size_t i = first; i < last; i++) {
+			const char* stem = members[i].stem;
+			size_t stem_len = strlen(stem);
+			for (int d = 0; d < pattern->deplen; d++) {
+				const char* dep = pattern->pattern_deps[d];
+				// the same for every member, once is enough
+				if (i > first && !strchr(dep, '%')) continue;
+				if (pattern_fill(path, sizeof(path), dep, stem, stem_len))
+					group.dependencies[group.deplen++] = node_intern(path);
+			}
+		}
+
+		snprintf(name, sizeof(name), ".unity-%04lx-%lu", tag,
+				 members[first].group);
+		if (!pattern_fill(path, sizeof(path), pattern->pattern_target, name,
+						  strlen(name)))
+			continue;
+		group.target = node_intern(path);
+		group.function = pattern->function;
+		group.command = pattern->command;
+		group.pattern_target = pattern->pattern_target;
+		group.pattern_deps = pattern->pattern_deps;
+		group.dir = pattern->dir;
+		recipe_add(group);
+
+		for (size_t i = first; i < last; i++) {
+			const char* stem = members[i].stem;
+			if (pattern_fill(path, sizeof(path), pattern->pattern_target,
+							 stem, strlen(stem)))
+				substitute_set(node_intern(path), group.target);
+		}
+	}
+	free(members);
+}
+
+// Points dependencies on members' objects at their groups' objects, once
+// all patterns are expanded
+void unity_substitute(void) {
+	if (!substitute) return;
+
+	// seen[node] is the last recipe (+ 1) that got it as a group object
+	size_t* seen = calloc(node_arr.count, sizeof(size_t));
+	if (!seen) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < recipe_arr.count; i++) {
+		Recipe* r = &recipe_arr.data[i];
+		if (r->target < 0) continue;
+		int n = 0;
+		for (int j = 0; j < r->deplen; j++) {
+			int dep = r->dependencies[j];
+			if ((size_t)dep < substitute_count && substitute[dep] >= 0) {
+				dep = substitute[dep];
+				if (seen[dep] == i + 1) continue;
+				seen[dep] = i + 1;
+			}
+			r->dependencies[n++] = dep;
+		}
+		r->deplen = n;
+	}
+	free(seen);
+}
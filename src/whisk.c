@@ -1,7 +1,90 @@
+#define _GNU_SOURCE  // pipe2, posix_spawn_file_actions_addchdir_np
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <lua5.3/lauxlib.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "bake.h"
+
+extern char** environ;
+
+// Runs cmd through /bin/sh in dir (NULL for the current directory), with
+// stdout and stderr collected into output. Safe to call from job threads,
+// returns the exit code (127 if the shell couldn't be started), or
+// RUN_TIMED_OUT if it was killed after timeout seconds (0 waits forever).
+int run_command(const char* cmd, const char* dir, double timeout,
+				LogBuffer* output) {
+	int fds[2];
+	// close-on-exec, or other jobs' children would hold our pipe open
+	if (pipe2(fds, O_CLOEXEC) != 0) return 127;
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+	if (dir) posix_spawn_file_actions_addchdir_np(&actions, dir);
+
+	// timed commands get their own process group, so whatever the shell
+	// started can be killed along with it
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	if (timeout > 0) {
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+		posix_spawnattr_setpgroup(&attr, 0);
+	}
+
+	pid_t pid;
+	char* argv[] = {"sh", "-c", (char*)cmd, NULL};
+	int err = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	close(fds[1]);
+	if (err != 0) {
+		close(fds[0]);
+		return 127;
+	}
+
+	char buf[4096];
+	ssize_t n;
+	double deadline = timeout > 0 ? now_seconds() + timeout : 0;
+	int timed_out = 0;
+	for (;;) {
+		if (deadline) {
+			double left = deadline - now_seconds();
+			if (left <= 0) {
+				kill(-pid, SIGKILL);
+				timed_out = 1;
+				break;
+			}
+			struct pollfd pfd = {fds[0], POLLIN, 0};
+			if (poll(&pfd, 1, (int)(left * 1000) + 1) <= 0) continue;
+		}
+		n = read(fds[0], buf, sizeof(buf));
+		if (n == 0) break;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		log_buffer_append(output, buf, n);
+	}
+	close(fds[0]);
+
+	int status;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) return 127;
+	}
+	if (timed_out) return RUN_TIMED_OUT;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
 int lw_handle_error(lua_State* L) {
 	// upvalue 1 = result table
 	luaL_checktype(L, lua_upvalueindex(1), LUA_TTABLE);
@@ -31,13 +114,130 @@ int lw_handle_error(lua_State* L) {
 	return 0;
 }
 
+// whisk(cmd, {cache = {inputs = {...}, env = {...}}}) keeps the result in
+// .bake/whisk/ and replays it for as long as the command, the directory it
+// runs in, the contents of the inputs and the values of the env variables
+// stay the same. Meant for pkg-config, git describe and compiler probes that
+// would otherwise run on every start. cache = true caches on the command and
+// the directory it runs in, -B runs them all again.
+
+// Hashes what a cached result depends on, the cache table is on top
+static unsigned long whisk_cache_key(lua_State* L, const char* cmd) {
+	char cwd[PATH_MAX];
+	unsigned long h = hash_string(cmd);
+	if (getcwd(cwd, sizeof(cwd))) h = hash_bytes(h, cwd, strlen(cwd) + 1);
+	if (!lua_istable(L, -1)) return h;
+
+	lua_getfield(L, -1, "inputs");
+	size_t count = lua_istable(L, -1) ? lua_rawlen(L, -1) : 0;
+	for (size_t i = 1; i <= count; i++) {
+		lua_rawgeti(L, -1, i);
+		const char* path = lua_tostring(L, -1);
+		if (path) h = hash_file(hash_bytes(h, path, strlen(path) + 1), path);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "env");
+	count = lua_istable(L, -1) ? lua_rawlen(L, -1) : 0;
+	for (size_t i = 1; i <= count; i++) {
+		lua_rawgeti(L, -1, i);
+		const char* name = lua_tostring(L, -1);
+		const char* value = name ? getenv(name) : NULL;
+		if (name) h = hash_bytes(h, name, strlen(name) + 1);
+		// unset and empty are different things to most probes
+		h = value ? hash_bytes(h, value, strlen(value) + 1)
+				  : hash_bytes(h, "", 1);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return h;
+}
+
+static void whisk_cache_path(char* buf, size_t size, unsigned long key) {
+	snprintf(buf, size, "%s/%s/whisk/%016lx", project_root, STATE_DIR, key);
+}
+
+// "bake-whisk 1 <return code> <length>\n" and the output
+static char* whisk_cache_load(unsigned long key, int* rc, size_t* len) {
+	char path[PATH_MAX];
+	whisk_cache_path(path, sizeof(path), key);
+	size_t size;
+	char* data = read_file(path, &size);
+	if (!data) return NULL;
+
+	int header = 0;
+	if (sscanf(data, "bake-whisk 1 %d %zu%n", rc, len, &header) != 2 ||
+		data[header] != '\n' || size - ++header != *len) {
+		free(data);
+		return NULL;
+	}
+	memmove(data, data + header, *len + 1);
+	return data;
+}
+
+static void whisk_cache_store(unsigned long key, int rc, const char* output,
+							  size_t len) {
+	char path[PATH_MAX], tmp[PATH_MAX + 8];
+	whisk_cache_path(path, sizeof(path), key);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (!mkdir_parents(path)) return;
+
+	// a cache that can't be written is only slower
+	FILE* f = fopen(tmp, "w");
+	if (!f) return;
+	fprintf(f, "bake-whisk 1 %d %zu\n", rc, len);
+	int ok = fwrite(output, 1, len, f) == len;
+	if (fclose(f) != 0 || !ok || rename(tmp, path) != 0) unlink(tmp);
+}
+
+static int push_result(lua_State* L, int rc, const char* output) {
+	lua_newtable(L);
+	lua_pushinteger(L, rc);
+	lua_setfield(L, -2, "return_code");
+	lua_pushstring(L, output);
+	lua_setfield(L, -2, "output");
+	lua_pushvalue(L, -1);
+	lua_pushcclosure(L, lw_handle_error, 1);
+	lua_setfield(L, -2, "err");
+	return 1;
+}
+
 int l_whisk(lua_State* L) {
 	const char* cmd = luaL_checkstring(L, 1);  // safe check
 
+	int cached = 0;
+	unsigned long key = 0;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "cache");
+		cached = lua_toboolean(L, -1);
+		if (cached) key = whisk_cache_key(L, cmd);
+		lua_pop(L, 1);
+	}
+	// a replayed command leaves nothing in the recipe's trace
+	if (cached && !args.force && !trace_current) {
+		int rc;
+		size_t len;
+		char* output = whisk_cache_load(key, &rc, &len);
+		if (output) {
+			stats.whisk_cache_hits++;
+			print("\x1b[2;90m$ %s (cached)\x1b[0m", cmd);
+			push_result(L, rc, output);
+			free(output);
+			return 1;
+		}
+	}
+	if (cached) stats.whisk_cache_misses++;
+
 	print("\x1b[2;90m$ %s\x1b[0m", cmd);
 
-	FILE* pipe = popen(cmd, "r");
+	char* traced = trace_current ? trace_wrap(cmd, trace_current) : NULL;
+	double start = now_seconds();
+	FILE* pipe = popen(traced ? traced : cmd, "r");
+	free(traced);
 	if (!pipe) return luaL_error(L, "Failed to run command");
+	stats.spawns++;
 
 	// Read command output dynamically
 	size_t bufsize = 1024;
@@ -65,21 +265,15 @@ int l_whisk(lua_State* L) {
 	output[len] = '\0';
 
 	int ret = pclose(pipe);
+	stats.child_time += now_seconds() - start;
+	stats.output_bytes += len;
 	if (ret == -1) {
 		free(output);
 		return luaL_error(L, "Failed to close command pipe");
 	}
 
-	// Push result table
-	lua_newtable(L);
-	lua_pushinteger(L, WEXITSTATUS(ret));
-	lua_setfield(L, -2, "return_code");
-	lua_pushstring(L, output);
-	lua_setfield(L, -2, "output");
-	lua_pushvalue(L, -1);
-	lua_pushcclosure(L, lw_handle_error, 1);
-	lua_setfield(L, -2, "err");
-
+	if (cached) whisk_cache_store(key, WEXITSTATUS(ret), output, len);
+	push_result(L, WEXITSTATUS(ret), output);
 	free(output);
 	return 1;
 }
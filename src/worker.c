@@ -0,0 +1,350 @@
+#define _GNU_SOURCE	 // mkdtemp, SOCK_CLOEXEC
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "bake.h"
+
+// Worker protocol, over a stream socket. Integers are 32 bit big endian,
+// blobs are a length followed by that many bytes.
+//
+//   file:     blob path, present, mode, blob contents
+//   request:  blob "BAKE2", blob dir, blob command,
+//             count, count * file (inputs),
+//             count, count * blob path (expected outputs)
+//   response: exit code, blob output, count, count * file (outputs)
+//
+// Paths are relative to the project root, the command runs in dir ("" for
+// the root itself). A connection carries any number of jobs, one after the
+// other.
+
+#define WORKER_MAGIC "BAKE2"
+
+static int send_all(int fd, const void* data, size_t len) {
+	const char* p = data;
+	while (len > 0) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return 0;
+		}
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int recv_all(int fd, void* data, size_t len) {
+	char* p = data;
+	while (len > 0) {
+		ssize_t n = recv(fd, p, len, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int send_u32(int fd, uint32_t v) {
+	v = htonl(v);
+	return send_all(fd, &v, sizeof(v));
+}
+
+static int recv_u32(int fd, uint32_t* v) {
+	if (!recv_all(fd, v, sizeof(*v))) return 0;
+	*v = ntohl(*v);
+	return 1;
+}
+
+static int send_blob(int fd, const char* data, size_t len) {
+	return send_u32(fd, (uint32_t)len) && send_all(fd, data, len);
+}
+
+static int send_str(int fd, const char* s) {
+	return send_blob(fd, s, strlen(s));
+}
+
+// Heap allocated and NUL terminated, NULL on a broken connection
+static char* recv_blob(int fd, uint32_t* len) {
+	uint32_t n;
+	if (!recv_u32(fd, &n)) return NULL;
+	char* data = malloc((size_t)n + 1);
+	if (!data) return NULL;
+	if (!recv_all(fd, data, n)) {
+		free(data);
+		return NULL;
+	}
+	data[n] = '\0';
+	if (len) *len = n;
+	return data;
+}
+
+// Paths are materialized under the current directory, so they must stay in it
+static int safe_path(const char* path) {
+	if (path[0] == '/' || path[0] == '\0') return 0;
+	const char* p = path;
+	while (p) {
+		if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+			return 0;
+		p = strchr(p, '/');
+		if (p) p++;
+	}
+	return 1;
+}
+
+// path below base, or below the current directory if base is NULL
+static const char* at_base(const char* base, const char* path, char* buf,
+						   size_t size) {
+	if (!base) return path;
+	snprintf(buf, size, "%s/%s", base, path);
+	return buf;
+}
+
+// Sends a file, or marks it as not present if it's missing or not safe
+static int send_file(int fd, const char* base, const char* path) {
+	char buf[PATH_MAX];
+	const char* full = at_base(base, path, buf, sizeof(buf));
+	struct stat st;
+	size_t len = 0;
+	char* data = NULL;
+	if (safe_path(path) && stat(full, &st) == 0) data = read_file(full, &len);
+
+	int ok = send_str(fd, path) && send_u32(fd, data != NULL) &&
+			 send_u32(fd, data ? st.st_mode : 0) &&
+			 send_blob(fd, data ? data : "", len);
+	free(data);
+	return ok;
+}
+
+static int write_file(const char* path, const char* data, size_t len,
+					  mode_t mode) {
+	if (!mkdir_parents(path)) return 0;
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode & 0777);
+	if (fd < 0) return 0;
+	int ok = 1;
+	while (ok && len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR) continue;
+		ok = n > 0;
+		if (ok) {
+			data += n;
+			len -= n;
+		}
+	}
+	return close(fd) == 0 && ok;
+}
+
+// Receives a file and writes it below base. Returns 0 if the connection
+// broke, *written tells whether the file made it to disk.
+static int recv_file(int fd, const char* base, int* written) {
+	char buf[PATH_MAX];
+	uint32_t present, mode, len;
+	char* path = recv_blob(fd, NULL);
+	char* data = NULL;
+	if (path && recv_u32(fd, &present) && recv_u32(fd, &mode))
+		data = recv_blob(fd, &len);
+
+	*written = 0;
+	if (data && present && safe_path(path))
+		*written = write_file(at_base(base, path, buf, sizeof(buf)), data,
+							  len, mode);
+	else if (data)
+		*written = !present;  // nothing to write isn't a failure
+	int ok = data != NULL;
+	free(path);
+	free(data);
+	return ok;
+}
+
+int worker_connect(const char* socket_path) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+// Client side: sends one job and waits for its result. The outputs are
+// written into the project. Returns 0 if the connection broke.
+int worker_run_job(int fd, const char* dir, const char* command,
+				   const char** inputs, int input_count, const char** outputs,
+				   int output_count, LogBuffer* log, int* exit_code) {
+	if (!send_str(fd, WORKER_MAGIC) || !send_str(fd, dir) ||
+		!send_str(fd, command))
+		return 0;
+
+	if (!send_u32(fd, input_count)) return 0;
+	for (int i = 0; i < input_count; i++) {
+		if (!send_file(fd, project_root, inputs[i])) return 0;
+	}
+
+	if (!send_u32(fd, output_count)) return 0;
+	for (int i = 0; i < output_count; i++) {
+		if (!send_str(fd, outputs[i])) return 0;
+	}
+
+	uint32_t code, count, len;
+	if (!recv_u32(fd, &code)) return 0;
+	char* output = recv_blob(fd, &len);
+	if (!output) return 0;
+	log_buffer_append(log, output, len);
+	free(output);
+	*exit_code = (int)code;
+
+	if (!recv_u32(fd, &count)) return 0;
+	for (uint32_t i = 0; i < count; i++) {
+		int written;
+		if (!recv_file(fd, project_root, &written)) return 0;
+		if (!written) {
+			const char* msg = "bake: could not write output from worker\n";
+			log_buffer_append(log, msg, strlen(msg));
+			if (*exit_code == 0) *exit_code = 1;
+		}
+	}
+	return 1;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag,
+						struct FTW* ftw) {
+	return remove(path);
+}
+
+// Worker side: runs one job in a scratch directory. Returns 0 once the
+// connection is closed or broken.
+static int worker_handle_job(int fd) {
+	char* magic = recv_blob(fd, NULL);
+	if (!magic) return 0;
+	int ok = strcmp(magic, WORKER_MAGIC) == 0;
+	free(magic);
+	if (!ok) return 0;
+
+	char* job_dir = recv_blob(fd, NULL);
+	char* command = job_dir ? recv_blob(fd, NULL) : NULL;
+	if (!command) {
+		free(job_dir);
+		return 0;
+	}
+
+	char dir[] = "/tmp/bake-job.XXXXXX";
+	if (!mkdtemp(dir)) {
+		free(job_dir);
+		free(command);
+		return 0;
+	}
+	int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	ok = cwd >= 0 && chdir(dir) == 0;
+
+	uint32_t count = 0;
+	ok = ok && recv_u32(fd, &count);
+	for (uint32_t i = 0; ok && i < count; i++) {
+		int written;
+		ok = recv_file(fd, NULL, &written);
+	}
+
+	uint32_t output_count = 0;
+	char** outputs = NULL;
+	ok = ok && recv_u32(fd, &output_count);
+	if (ok) outputs = calloc(output_count ? output_count : 1, sizeof(char*));
+	for (uint32_t i = 0; ok && outputs && i < output_count; i++) {
+		outputs[i] = recv_blob(fd, NULL);
+		ok = outputs[i] != NULL;
+		if (ok && safe_path(outputs[i])) mkdir_parents(outputs[i]);
+	}
+	ok = ok && outputs;
+
+	if (ok) {
+		// the sub-project directory may have no inputs or outputs in it
+		char sub[PATH_MAX];
+		int in_sub = job_dir[0] != '\0' && safe_path(job_dir);
+		snprintf(sub, sizeof(sub), "%s/", job_dir);
+		if (in_sub) mkdir_parents(sub);
+
+		print("\x1b[2;90m$ %s\x1b[0m", command);
+		LogBuffer log = {NULL, 0, 0};
+		int code = run_command(command, in_sub ? job_dir : NULL, 0, &log);
+
+		ok = send_u32(fd, code) && send_blob(fd, log.data ? log.data : "",
+											 log.len) &&
+			 send_u32(fd, output_count);
+		for (uint32_t i = 0; ok && i < output_count; i++) {
+			ok = send_file(fd, NULL, outputs[i]);
+		}
+		log_buffer_free(&log);
+	}
+
+	for (uint32_t i = 0; outputs && i < output_count; i++) free(outputs[i]);
+	free(outputs);
+	free(job_dir);
+	free(command);
+	if (cwd >= 0) {
+		if (fchdir(cwd) != 0) ok = 0;
+		close(cwd);
+	}
+	nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return ok;
+}
+
+// bake --worker <socket>: serves jobs until killed, one process per
+// connection so a Bake instance with several slots gets real parallelism.
+int worker_main(const char* socket_path) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		print("\x1b[31mSocket path too long: %s\x1b[0m", socket_path);
+		return 1;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	unlink(socket_path);
+	if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+		listen(fd, 16) != 0) {
+		print("\x1b[31mCan't listen on %s: %s\x1b[0m", socket_path,
+			  strerror(errno));
+		return 1;
+	}
+
+	signal(SIGCHLD, SIG_IGN);  // connection handlers reap themselves
+	print("\x1b[33mbake-worker listening on %s\x1b[0m", socket_path);
+
+	for (;;) {
+		int conn = accept(fd, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR) continue;
+			print("\x1b[31maccept: %s\x1b[0m", strerror(errno));
+			return 1;
+		}
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(fd);
+			signal(SIGCHLD, SIG_DFL);  // run_command waits for its shell
+			while (worker_handle_job(conn));
+			_exit(0);
+		}
+		if (pid < 0) print("\x1b[31mfork: %s\x1b[0m", strerror(errno));
+		close(conn);
+	}
+}